@@ -0,0 +1,182 @@
+//
+//  ASTIndex.cpp
+//  Framework X
+//
+//  Created by Ruben Opdebeeck on 20/06/2017.
+//  Copyright © 2017 Ruben Opdebeeck. All rights reserved.
+//
+
+#include "ASTIndex.hpp"
+#include "LHSTemplateParser.hpp"
+#include "LHSComparators.hpp"
+
+using namespace X;
+
+map<const ASTUnit *, pair<weak_ptr<ASTUnit>, weak_ptr<ASTIndex>>> ASTIndex::sharedIndexes;
+mutex ASTIndex::sharedIndexesMutex;
+
+/// \class ASTIndexBuilder
+/// \brief Helper class adding every Decl and Stmt in the main file to an index, including those expanded from
+/// a macro used in the main file.
+/// The parent of a node is taken from the path of nodes the traversal is in, rather
+/// than from ASTContext::getParents, which would build a parent map for the entire AST.
+class X::ASTIndexBuilder : public RecursiveASTVisitor<ASTIndexBuilder> {
+    ASTIndex &index;
+    SourceManager &sm;
+    
+    /// The Decls and Stmts being traversed, from the translation unit down to the node being visited
+    llvm::SmallVector<DynTypedNode, 32> traversalPath;
+    
+    /// The entries of the nodes in the traversal path, IndexedNode::NotIndexed for nodes that are not in the index
+    llvm::SmallVector<unsigned, 32> entryPath;
+    
+    /// Add the node being visited to the index, if it is in the main file.
+    /// Instead of a parent map, each entry refers to the entry of its parent. Parents outside the main file, such as
+    /// implicit nodes without a location, have no entry, so walking up from a node stops at them.
+    void addNode(ASTNodeKind kind, bool inMainFile) {
+        if (traversalPath.size() < 2 || !inMainFile) return;
+        
+        vector<IndexedNode> &nodes(index.nodesByKind[kind].nodes);
+        entryPath.back() = nodes.size();
+        nodes.push_back(IndexedNode(traversalPath.back(), traversalPath[traversalPath.size() - 2], entryPath[entryPath.size() - 2]));
+    }
+    
+    /// Check if a location is in the main file, or in a macro expanded in the main file
+    bool isInMainFile(SourceLocation loc) {
+        return sm.isWrittenInMainFile(sm.getExpansionLoc(loc));
+    }
+    
+    public:
+    ASTIndexBuilder(ASTIndex &idx, SourceManager &srcMgr) : index(idx), sm(srcMgr) {}
+    
+    // Override the Traverse* methods for the base AST nodes to keep track of the traversal path
+    bool TraverseStmt(Stmt *S) {
+        if (!S) return true;
+        
+        traversalPath.push_back(DynTypedNode::create(*S));
+        entryPath.push_back(IndexedNode::NotIndexed);
+        bool result = RecursiveASTVisitor<ASTIndexBuilder>::TraverseStmt(S);
+        entryPath.pop_back();
+        traversalPath.pop_back();
+        return result;
+    }
+    
+    bool TraverseDecl(Decl *D) {
+        // Don't descend into declarations from included files, e.g. the standard library
+        if (!D || isFileLevelDeclOutsideMainFile(D, sm)) return true;
+        
+        traversalPath.push_back(DynTypedNode::create(*D));
+        entryPath.push_back(IndexedNode::NotIndexed);
+        bool result = RecursiveASTVisitor<ASTIndexBuilder>::TraverseDecl(D);
+        entryPath.pop_back();
+        traversalPath.pop_back();
+        return result;
+    }
+    
+    bool VisitStmt(Stmt *S) {
+        // Ignore header Stmts
+        addNode(ASTNodeKind::getFromNode(*S), isInMainFile(S->getLocStart()));
+        return true;
+    }
+    
+    bool VisitDecl(Decl *D) {
+        // Ignore header Decls
+        addNode(ASTNodeKind::getFromNode(*D), isInMainFile(D->getLocStart()));
+        return true;
+    }
+};
+
+ASTIndex::ASTIndex(ASTUnit &ast) {
+    ASTIndexBuilder builder(*this, ast.getSourceManager());
+    builder.TraverseDecl(ast.getASTContext().getTranslationUnitDecl());
+}
+
+shared_ptr<ASTIndex> ASTIndex::forAST(const shared_ptr<ASTUnit> &ast) {
+    lock_guard<mutex> lock(sharedIndexesMutex);
+    
+    // The address of a freed AST may be reused by a new AST, whose index must be built anew
+    auto &entry(sharedIndexes[ast.get()]);
+    if (!entry.first.expired()) {
+        if (shared_ptr<ASTIndex> index = entry.second.lock()) return index;
+    }
+    
+    // The map only refers to the index, it is removed from the map when its last user releases it
+    const ASTUnit *key(ast.get());
+    shared_ptr<ASTIndex> index(new ASTIndex(*ast), [key](ASTIndex *index) {
+        {
+            lock_guard<mutex> lock(sharedIndexesMutex);
+            auto it(sharedIndexes.find(key));
+            if (it != sharedIndexes.end() && it->second.second.expired()) sharedIndexes.erase(it);
+        }
+        delete index;
+    });
+    entry = { ast, index };
+    
+    return index;
+}
+
+const vector<IndexedNode> &ASTIndex::getNodesOfKind(ASTNodeKind kind) {
+    auto it(nodesByKind.find(kind));
+    if (it == nodesByKind.end()) {
+        static const vector<IndexedNode> noNodes;
+        return noNodes;
+    }
+    
+    KindBucket &bucket(it->second);
+    if (!bucket.siblingIndicesResolved) {
+        for (IndexedNode &indexed : bucket.nodes) {
+            indexed.siblingIndex = getSiblingIndex(indexed.parent, indexed.node);
+        }
+        bucket.siblingIndicesResolved = true;
+    }
+    
+    return bucket.nodes;
+}
+
+size_t ASTIndex::countNodesOfKind(ASTNodeKind kind) const {
+    auto it(nodesByKind.find(kind));
+    return it != nodesByKind.end() ? it->second.nodes.size() : 0;
+}
+
+const vector<const IndexedNode *> &ASTIndex::getNodesWithValue(ASTNodeKind kind, const string &value) {
+    static const vector<const IndexedNode *> noNodes;
+    auto it(nodesByKind.find(kind));
+    if (it == nodesByKind.end()) return noNodes;
+    
+    KindBucket &bucket(it->second);
+    if (!bucket.valuesResolved) {
+        string key;
+        for (const IndexedNode &indexed : bucket.nodes) {
+            if (getValueKey(indexed.node, key)) bucket.nodesByValue[key].push_back(&indexed);
+        }
+        bucket.valuesResolved = true;
+    }
+    
+    auto valueIt(bucket.nodesByValue.find(value));
+    return valueIt != bucket.nodesByValue.end() ? valueIt->second : noNodes;
+}
+
+const IndexedNode *ASTIndex::getParentEntry(const IndexedNode &indexed) const {
+    if (indexed.parentEntry == IndexedNode::NotIndexed) return nullptr;
+    
+    auto it(nodesByKind.find(indexed.parent.getNodeKind()));
+    return it != nodesByKind.end() ? &it->second.nodes[indexed.parentEntry] : nullptr;
+}
+
+unsigned ASTIndex::getSiblingIndex(const DynTypedNode &parent, const DynTypedNode &child) {
+    auto it(siblingIndices.find(child.getMemoizationData()));
+    if (it != siblingIndices.end()) return it->second;
+    
+    // Scan the parent's child list once, which also resolves the indices of the child's siblings
+    const vector<ASTNode> &siblings(ASTNode(parent, &nodeCache).getChildren());
+    for (unsigned i = 0; i < siblings.size(); i++) {
+        if (!siblings[i].isVirtual()) {
+            siblingIndices[siblings[i].getNode().getMemoizationData()] = i;
+        }
+    }
+    
+    // Record the child as no child of its parent if it wasn't found, so the scan is not repeated for it
+    auto &index(siblingIndices[child.getMemoizationData()]);
+    if (index >= siblings.size() || !(siblings[index].getNode() == child)) index = IndexedNode::NotAChild;
+    return index;
+}
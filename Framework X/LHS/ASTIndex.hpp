@@ -0,0 +1,120 @@
+//
+//  ASTIndex.hpp
+//  Framework X
+//
+//  Created by Ruben Opdebeeck on 20/06/2017.
+//  Copyright © 2017 Ruben Opdebeeck. All rights reserved.
+//
+
+#ifndef ASTIndex_hpp
+#define ASTIndex_hpp
+
+#include <vector>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+
+#include <clang/AST/ASTTypeTraits.h>
+#include <clang/Frontend/ASTUnit.h>
+#include <llvm/ADT/DenseMap.h>
+
+#include "ASTTraversalState.hpp"
+
+using namespace clang::ast_type_traits;
+using namespace clang;
+using namespace std;
+
+namespace X {
+
+class ASTIndexBuilder;
+
+/// \struct IndexedNode
+/// \brief A node in the main file of an AST, along with its position in the AST.
+struct IndexedNode {
+    /// Sibling index of nodes which are not represented as a child of their parent, e.g. parameters,
+    /// whose ASTNode is a child of a virtual parameter list instead.
+    static const unsigned NotAChild = ~0u;
+    
+    /// Entry of parents which are not in the index, e.g. the translation unit.
+    static const unsigned NotIndexed = ~0u;
+    
+    DynTypedNode node;
+    DynTypedNode parent;
+    unsigned siblingIndex; ///< The index of the node in the ASTNode child list of its parent
+    unsigned parentEntry; ///< The position of the parent among the indexed nodes of its kind, see ASTIndex::getParentEntry
+    
+    IndexedNode(DynTypedNode n, DynTypedNode p, unsigned pe) : node(n), parent(p), siblingIndex(NotAChild), parentEntry(pe) {}
+};
+
+/// \class ASTIndex
+/// \brief An index of the Stmts and Decls in the main file of an AST, grouped by node kind.
+/// Nodes expanded from a macro are indexed when the macro is used in the main file, so a template node
+/// written as a macro is found as well.
+/// The index is built in a single traversal of the AST, and replaces a traversal of the entire AST for every
+/// template matched on it. It also owns the ASTNodeCache holding the child lists of the AST's nodes.
+///
+/// Indexes are shared: forAST returns the same index for an AST for as long as the index is in use, so
+/// multiple templates matched on the same AST in one process use the same index. The index is freed along with its
+/// last user, e.g. the last ASTResult referring to it.
+/// Lookups resolve sibling indices and values lazily, without locking, so an index must not be used by multiple
+/// threads at the same time.
+class ASTIndex {
+    /// The nodes of one kind, sibling indices and values are only resolved once they are requested
+    struct KindBucket {
+        vector<IndexedNode> nodes;
+        bool siblingIndicesResolved = false;
+        
+        /// The nodes with each value key, see getValueKey
+        map<string, vector<const IndexedNode *>> nodesByValue;
+        bool valuesResolved = false;
+    };
+    
+    map<ASTNodeKind, KindBucket> nodesByKind;
+    ASTNodeCache nodeCache;
+    
+    /// The index of every child of a parent in its parent's child list, for parents whose child list was scanned
+    llvm::DenseMap<const void *, unsigned> siblingIndices;
+    
+    /// The indexes in use, which remove themselves from the map when they are freed
+    static map<const ASTUnit *, pair<weak_ptr<ASTUnit>, weak_ptr<ASTIndex>>> sharedIndexes;
+    static mutex sharedIndexesMutex;
+    
+    friend class ASTIndexBuilder;
+
+public:
+    /// Build the index of an AST.
+    ASTIndex(ASTUnit &ast);
+    
+    /// Retrieve the shared index of an AST, building it if there is none yet.
+    static shared_ptr<ASTIndex> forAST(const shared_ptr<ASTUnit> &ast);
+    
+    /// Retrieve the nodes of the given kind, in the order they occur in the AST.
+    /// Derived kinds are not included, e.g. retrieving Stmts does not return any Exprs.
+    /// Resolves the sibling indices of the nodes on first use, which modifies the index without locking.
+    const vector<IndexedNode> &getNodesOfKind(ASTNodeKind kind);
+    
+    /// Count the nodes of the given kind, without resolving their sibling indices.
+    size_t countNodesOfKind(ASTNodeKind kind) const;
+    
+    /// Retrieve the nodes of the given kind whose value key is the given value, see getValueKey.
+    /// Their sibling indices are not resolved. Groups the nodes by value on first use, which modifies the index
+    /// without locking.
+    const vector<const IndexedNode *> &getNodesWithValue(ASTNodeKind kind, const string &value);
+    
+    /// Retrieve the entry of an indexed node's parent, to walk up from the node without a parent map of the entire AST.
+    /// \return The entry, or nullptr if the parent is not in the index.
+    const IndexedNode *getParentEntry(const IndexedNode &indexed) const;
+    
+    /// Scan the child list of a parent, if that hasn't been done yet, and retrieve the index of a child in it.
+    /// Scanning modifies the index without locking.
+    /// \return The index of the child, or IndexedNode::NotAChild if the child is not in the parent's child list.
+    unsigned getSiblingIndex(const DynTypedNode &parent, const DynTypedNode &child);
+    
+    /// Retrieve the cache holding the child lists of the AST's nodes, to be used for any ASTNode in the AST.
+    ASTNodeCache &getNodeCache() { return nodeCache; }
+};
+    
+} // namespace X
+
+#endif /* ASTIndex_hpp */
@@ -7,6 +7,11 @@
 //
 
 #include "ASTTraversalState.hpp"
+#include "LHSComparators.hpp"
+
+#include <algorithm>
+
+#include <llvm/ADT/Hashing.h>
 
 using namespace X;
 
@@ -17,25 +22,34 @@ ASTNodeKind ASTNode::DeclStmtKind = ASTNodeKind::getFromNodeKind<DeclStmt>();
 ASTNodeKind ASTNode::FunctionDeclKind = ASTNodeKind::getFromNodeKind<FunctionDecl>();
 ASTNodeKind ASTNode::VarDeclKind = ASTNodeKind::getFromNodeKind<VarDecl>();
 ASTNodeKind ASTNode::FieldDeclKind = ASTNodeKind::getFromNodeKind<FieldDecl>();
+shared_ptr<const vector<ASTNode>> ASTNode::emptyChildList = make_shared<const vector<ASTNode>>();
 
-vector<ASTNode> &ASTNode::getChildren() {
+const vector<ASTNode> &ASTNode::getChildren() const {
     // If the child list has been instantiated, just return it
-    if (childrenAdded) return children;
+    if (children) return *children;
     
+    // We still need to instantiate the child list, or retrieve it from the cache
+    if (cache) children = cache->getChildren(node);
+    else children = make_shared<const vector<ASTNode>>(createChildren(node, nullptr));
+    
+    return *children;
+}
+
+vector<ASTNode> ASTNode::createChildren(const DynTypedNode &node, ASTNodeCache *cache) {
+    vector<ASTNode> children;
     ASTNodeKind nodeKind(node.getNodeKind());
     
-    // We still need to instantiate the child list
     // Depending on the type of the underlying node, children are accessed in different ways
     if (StmtKind.isBaseOf(nodeKind)) {
         // For Stmts, in the general case the children are accessed using its children() range.
         // However, for DeclStmts, we need to access them by its decls() range.
         if (DeclStmtKind.isBaseOf(nodeKind)) {
             for (const Decl *D : node.get<DeclStmt>()->decls()) {
-                children.push_back(ASTNode(DynTypedNode::create(*D)));
+                children.push_back(ASTNode(DynTypedNode::create(*D), cache));
             }
         } else {
             for (const Stmt *child : node.get<Stmt>()->children()) {
-                if (child) children.push_back(ASTNode(DynTypedNode::create(*child)));
+                if (child) children.push_back(ASTNode(DynTypedNode::create(*child), cache));
                 else children.push_back(ASTNode());
             }
         }
@@ -51,143 +65,254 @@ vector<ASTNode> &ASTNode::getChildren() {
             vector<ASTNode> params;
             const FunctionDecl *FD(node.get<FunctionDecl>());
             for (ParmVarDecl *P : FD->parameters()) {
-                params.push_back(ASTNode(DynTypedNode::create(*P)));
+                params.push_back(ASTNode(DynTypedNode::create(*P), cache));
             }
             children.push_back(ASTNode(params)); // Virtual ASTNode
             
             // Body if there is one (declaration with definition)
             if (FD->isThisDeclarationADefinition()) {
-                children.push_back(ASTNode(DynTypedNode::create(*FD->getBody())));
+                children.push_back(ASTNode(DynTypedNode::create(*FD->getBody()), cache));
             }
         }
         
         // VarDecl/FieldDecl/ParmVarDecl
         // The only child is the initializer
         else if (VarDeclKind.isBaseOf(nodeKind) && node.get<VarDecl>()->hasInit()) { // Also works for ParmVarDecl
-            children.push_back(ASTNode(DynTypedNode::create(*node.get<VarDecl>()->getInit())));
+            children.push_back(ASTNode(DynTypedNode::create(*node.get<VarDecl>()->getInit()), cache));
         } else if (FieldDeclKind.isBaseOf(nodeKind) && node.get<FieldDecl>()->hasInClassInitializer()) {
-            children.push_back(ASTNode(DynTypedNode::create(*node.get<FieldDecl>()->getInClassInitializer())));
+            children.push_back(ASTNode(DynTypedNode::create(*node.get<FieldDecl>()->getInClassInitializer()), cache));
         }
         
         // DeclContext
         else if (llvm::isa<DeclContext>(node.get<Decl>())) {
             for (Decl *child : cast<DeclContext>(node.get<Decl>())->decls()) {
-                children.push_back(ASTNode(DynTypedNode::create(*child)));
+                children.push_back(ASTNode(DynTypedNode::create(*child), cache));
             }
         }
         
         // Anything else does not have children
     }
     
-    childrenAdded = true;
     return children;
 }
 
-vector<ASTNode> ASTNode::fromParentAndChild(DynTypedNode &parent, DynTypedNode &child) {
-    // Create an ASTNode from the parent and get its children
-    ASTNode parentASTNode(parent);
-    auto children(parentASTNode.getChildren());
-    
-    // Find the child we want
-    auto childIt(children.end());
-    for (auto it = children.begin(); it != children.end(); it++) {
-        if (it->getNode() == child) {
-            childIt = it;
-            break;
-        }
+const shared_ptr<const vector<ASTNode>> &ASTNodeCache::getChildren(const DynTypedNode &realNode) {
+    auto &childList(childLists[realNode.getMemoizationData()]);
+    if (!childList) childList = make_shared<const vector<ASTNode>>(ASTNode::createChildren(realNode, this));
+    return childList;
+}
+
+size_t ASTNode::getStructuralHash() const {
+    if (cache && !virtualNode) return cache->getStructuralHash(*this);
+    return computeStructuralHash();
+}
+
+size_t ASTNode::computeStructuralHash() const {
+    auto &childList(getChildren());
+    llvm::hash_code hash(llvm::hash_combine(virtualNode, virtualNode ? 0 : hashNode(node), childList.size()));
+    for (const ASTNode &child : childList) {
+        hash = llvm::hash_combine(hash, child.getStructuralHash());
     }
     
-    // Add the relevant children, i.e. the ones starting from the child we want, to a vector
-    vector<ASTNode> relevantChildren;
-    vector<ASTNode> results;
-    for (; childIt < children.end(); childIt++) {
-        relevantChildren.push_back(*childIt);
-        results.push_back(ASTNode(relevantChildren)); // Use the vector copy to our advantage
+    return hash;
+}
+
+size_t ASTNodeCache::getStructuralHash(const ASTNode &realNode) {
+    const void *key(realNode.getNode().getMemoizationData());
+    auto it(structuralHashes.find(key));
+    if (it != structuralHashes.end()) return it->second;
+    
+    // Computing the hash fills in the hashes of the node's descendants, so look up the entry again afterwards
+    size_t hash(realNode.computeStructuralHash());
+    structuralHashes[key] = hash;
+    return hash;
+}
+
+SubtreeFeatures SubtreeFeatures::ofNode(const ASTNode &node) {
+    SubtreeFeatures result;
+    if (node.isVirtual()) return result;
+    
+    // Stmt classes and Decl kinds are interleaved, so they don't share bits more often than needed
+    unsigned kind(0);
+    if (const Stmt *stmt = node.getNode().get<Stmt>()) kind = 2 * stmt->getStmtClass();
+    else if (const Decl *decl = node.getNode().get<Decl>()) kind = 2 * decl->getKind() + 1;
+    result.kindBloom = uint64_t(1) << (kind % 64);
+    return result;
+}
+
+void SubtreeFeatures::addChild(const SubtreeFeatures &child) {
+    nodeCount += child.nodeCount;
+    height = max(height, child.height + 1);
+    childCount++;
+    kindBloom |= child.kindBloom;
+}
+
+SubtreeFeatures ASTNode::getFeatures() const {
+    if (cache && !virtualNode) return cache->getFeatures(*this);
+    return computeFeatures();
+}
+
+SubtreeFeatures ASTNode::computeFeatures() const {
+    SubtreeFeatures result(SubtreeFeatures::ofNode(*this));
+    for (const ASTNode &child : getChildren()) {
+        result.addChild(child.getFeatures());
     }
     
-    // Create a virtual ASTNode and return it
-    return results;
+    return result;
+}
+
+SubtreeFeatures ASTNodeCache::getFeatures(const ASTNode &realNode) {
+    const void *key(realNode.getNode().getMemoizationData());
+    auto it(features.find(key));
+    if (it != features.end()) return it->second;
+    
+    SubtreeFeatures result(realNode.computeFeatures());
+    features[key] = result;
+    return result;
+}
+
+unsigned ASTNode::indexOfChild(const DynTypedNode &child) const {
+    auto &siblings(getChildren());
+    unsigned i = 0;
+    while (i < siblings.size() && !(siblings[i].getNode() == child)) i++;
+    return i;
 }
 
 bool ASTTraversalState::isLastChild() {
-    return currNodeIdx + 1 == parents.top().getChildren().size();
+    return path.back().index + 1 == path.back().siblings->size();
 }
 
 bool ASTTraversalState::astProcessed() {
-    return parents.empty();
+    return path.empty();
 }
 
 bool ASTTraversalState::hasChildren() {
-    return parents.top().getChildren()[currNodeIdx].getChildren().size() != 0;
+    return currentNode().getChildren().size() != 0;
 }
 
-bool ASTTraversalState::childrenAccessed() {
-    return parents.top().getChildren()[currNodeIdx].areChildrenAccessed();
+const DynTypedNode &ASTTraversalState::getCurrent() {
+    return currentNode().getNode();
 }
 
-DynTypedNode &ASTTraversalState::getCurrent() {
-    return parents.top().getChildren()[currNodeIdx].getNode();
-}
-
-DynTypedNode &ASTTraversalState::backtrackToParent() {
-    ASTNode parent(parents.top());
-    parents.pop();
+void ASTTraversalState::backtrackToParent() {
+    // Leaving the root's child list fixes the end of the span
+    if (path.size() == 1) spanEnd = path.back().index;
     
-    // Search the parent in its parent, set the new currNodeIdx to its index
-    // Only if there are parents left
-    if (!parents.empty()) {
-        auto siblings(parents.top().getChildren());
-        for (unsigned i = 0; i < siblings.size(); i++) {
-            if (siblings[i] == parent) {
-                currNodeIdx = i;
-                break;
-            }
-        }
-    }
-    
-    return parent.getNode();
+    // The parent's frame still holds its index
+    path.pop_back();
 }
 
-DynTypedNode &ASTTraversalState::nextSibling() {
+const DynTypedNode &ASTTraversalState::nextSibling() {
     if (isLastChild()) throw runtime_error("No more siblings");
     
-    return parents.top().getChildren()[++currNodeIdx].getNode();
+    path.back().index++;
+    return currentNode().getNode();
 }
 
-DynTypedNode &ASTTraversalState::descendToChild() {
+const DynTypedNode &ASTTraversalState::descendToChild() {
     if (!hasChildren()) throw runtime_error("No children");
     
-    auto &curr(parents.top().getChildren()[currNodeIdx]);
-    curr.setChildrenAccessed(true);
-    parents.push(curr);
-    currNodeIdx = 0;
-    return curr.getChildren()[0].getNode();
+    path.push_back({ &currentNode().getChildren(), 0 });
+    return currentNode().getNode();
 }
 
 vector<DynTypedNode> PotentialMatch::getMatchRoot() {
     vector<DynTypedNode> rootList;
-    vector<ASTNode> &subtrees(root.getChildren());
-    for (ASTNode &node : subtrees) {
-        rootList.push_back(node.getNode());
+    const vector<ASTNode> &subtrees(root.getChildren());
+    for (unsigned i = spanBegin; i <= spanEnd; i++) {
+        rootList.push_back(subtrees[i].getNode());
     }
     return rootList;
 }
 
-void PotentialMatch::instantiateCurrentAsMetavariable(Metavariable &meta) {
-    metavarInstantiations.insert(pair<Metavariable, ASTNode>(meta, parents.top().getChildren()[currNodeIdx]));
+/// Match a type name against a pattern, where * matches any sequence of characters.
+static bool matchesTypePattern(StringRef type, StringRef pattern) {
+    // Greedy matching, backtracking to the last * on a mismatch
+    size_t t(0), p(0), starP(StringRef::npos), starT(0);
+    while (t < type.size()) {
+        if (p < pattern.size() && pattern[p] == '*') {
+            starP = p++;
+            starT = t;
+        } else if (p < pattern.size() && pattern[p] == type[t]) {
+            p++;
+            t++;
+        } else if (starP != StringRef::npos) {
+            p = starP + 1;
+            t = ++starT;
+        } else {
+            return false;
+        }
+    }
+    
+    while (p < pattern.size() && pattern[p] == '*') p++;
+    return p == pattern.size();
+}
+
+bool PotentialMatch::satisfiesConstraints(const Metavariable &meta, const ASTNode &node) {
+    ASTNodeKind kind(node.getNode().getNodeKind());
+    if (!meta.kinds.empty() && none_of(meta.kinds.begin(), meta.kinds.end(),
+                                       [&](const ASTNodeKind &allowed) { return allowed.isBaseOf(kind); })) return false;
+    
+    if (!meta.typePattern.empty()) {
+        const Expr *expr(node.getNode().get<Expr>());
+        if (!expr || !matchesTypePattern(expr->getType().getAsString(), meta.typePattern)) return false;
+    }
+    
+    return true;
+}
+
+bool PotentialMatch::instantiateCurrentAsMetavariable(const Metavariable &meta) {
+    if (!satisfiesConstraints(meta, currentNode())) return false;
+    
+    bindings.push_back({ &meta, path.back().siblings, path.back().index, path.back().index, false });
+    return true;
+}
+
+bool PotentialMatch::instantiateSpanAsMetavariable(const Metavariable &meta, unsigned length, unsigned checked) {
+    TraversalFrame &frame(path.back());
+    if (length == 0 || frame.index + length > frame.siblings->size()) return false;
+    
+    for (unsigned i = frame.index + checked; i < frame.index + length; i++) {
+        if (!satisfiesConstraints(meta, (*frame.siblings)[i])) return false;
+    }
+    
+    bindings.push_back({ &meta, frame.siblings, frame.index, frame.index + length - 1, true });
+    frame.index += length - 1; // Set the current node to the last node in the instantiation
+    return true;
 }
 
-void PotentialMatch::extendForMetavariable(Metavariable &meta, vector<PotentialMatch> &potentials) {
-    auto &siblings(parents.top().getChildren());
-    vector<ASTNode> instanceNodes;
-    // The vector passed to the constructor of ASTNode is passed by value, i.e. copied, so we can
-    // destructively modify it at each step and give a copy to each new potential match that is created
-    for (unsigned i = currNodeIdx; i < siblings.size(); i++) {
-        instanceNodes.push_back(siblings[i]);
-        PotentialMatch newMatch(*this);
-        ASTNode instance(instanceNodes);
-        newMatch.metavarInstantiations.insert(pair<Metavariable, ASTNode>(meta, instance));
-        newMatch.currNodeIdx = i; // Set the current node to the last node in the instantiation 
-        potentials.push_back(newMatch);
+void PotentialMatch::bindMetavariables() {
+    for (const MetavariableBinding &binding : bindings) {
+        if (metavarInstantiations.find(*binding.meta) != metavarInstantiations.end()) continue;
+        
+        auto first(binding.siblings->begin() + binding.first);
+        if (binding.span) {
+            ASTNode instance(vector<ASTNode>(first, binding.siblings->begin() + binding.last + 1));
+            metavarInstantiations.insert(pair<Metavariable, ASTNode>(*binding.meta, instance));
+        } else {
+            metavarInstantiations.insert(pair<Metavariable, ASTNode>(*binding.meta, *first));
+        }
+    }
+    bindings.clear();
+}
+
+void PotentialMatch::restore(const Checkpoint &cp) {
+    path = cp.path;
+    spanEnd = cp.spanEnd;
+    bindings.resize(cp.bindingCount);
+}
+
+bool MetavariableSplits::next(PotentialMatch &pot) {
+    // The potential match is still at the start before the first instantiation
+    if (length > 0) pot.restore(start);
+    
+    unsigned nextLength(max(length + 1, meta->minNodes));
+    if (meta->maxNodes != 0 && nextLength > meta->maxNodes) return false;
+    
+    // The siblings of the previous instantiation were checked when it was produced
+    if (pot.instantiateSpanAsMetavariable(*meta, nextLength, length)) {
+        length = nextLength;
+        return true;
     }
+    return false;
 }
@@ -10,11 +10,14 @@
 #define ASTTraversalState_hpp
 
 #include <vector>
+#include <memory>
 
 #include <clang/AST/Expr.h>
 #include <clang/AST/Stmt.h>
 #include <clang/AST/ASTTypeTraits.h>
 #include <clang/Frontend/ASTUnit.h>
+#include <llvm/ADT/DenseMap.h>
+#include <llvm/ADT/SmallVector.h>
 
 #include "LHSConfiguration.hpp"
 
@@ -23,7 +26,36 @@ using namespace clang;
 using namespace std;
 
 namespace X {
+
+class ASTNodeCache;
+class ASTNode;
+
+/// \struct SubtreeFeatures
+/// \brief A compact summary of the shape of a subtree, to reject subtrees that can't contain a template subtree
+/// before comparing any node. Virtual nodes count as nodes, but have no kind.
+struct SubtreeFeatures {
+    unsigned nodeCount; ///< The number of nodes in the subtree
+    unsigned height; ///< The number of nodes on the longest path from the root down to a leaf
+    unsigned childCount; ///< The number of children of the root
+    uint64_t kindBloom; ///< A bloom signature of the kinds of the nodes in the subtree
+    
+    /// Create the features of a single node of unknown kind.
+    SubtreeFeatures() : nodeCount(1), height(1), childCount(0), kindBloom(0) {}
     
+    /// Create the features of a node on its own, without its children.
+    static SubtreeFeatures ofNode(const ASTNode &node);
+    
+    /// Add a child subtree with the given features to the root.
+    void addChild(const SubtreeFeatures &child);
+    
+    /// Check if a subtree with these features can contain the required features, i.e. it is at least as large
+    /// and contains all of the required kinds.
+    bool satisfies(const SubtreeFeatures &required) const {
+        return nodeCount >= required.nodeCount && height >= required.height && childCount >= required.childCount
+            && (kindBloom & required.kindBloom) == required.kindBloom;
+    }
+};
+
 /// \class ASTNode
 /// \brief Generic representation of an AST node with its children, in order to facilitate AST traversal.
 /// Different AST nodes have different ways to access its children, this class tries to generalize that.
@@ -34,7 +66,8 @@ namespace X {
 /// and add these as two children of the FunctionDecl.
 ///
 /// Child lists are only instantiated once the children get accessed. This way, no expensive instantiation
-/// is performed when this node does not match.
+/// is performed when this node does not match. Child lists are shared between copies of an ASTNode, and
+/// when the ASTNode was created with an ASTNodeCache, between all ASTNodes representing the same real node.
 ///
 /// This class allows us to build and use a hierarchical representation of an AST without having to worry
 /// about the different representations of AST nodes and its children.
@@ -50,103 +83,173 @@ class ASTNode {
     static ASTNodeKind VarDeclKind;
     static ASTNodeKind FieldDeclKind;
     
+    /// The child list shared by all virtual ASTNodes without children
+    static shared_ptr<const vector<ASTNode>> emptyChildList;
+    
     DynTypedNode node; ///< The real AST node this object represents, or nullptr when it's a virtual AST node.
-    vector<ASTNode> children; ///< A list of children for this AST node, accessed in a general way.
+    mutable shared_ptr<const vector<ASTNode>> children; ///< A list of children for this AST node, accessed in a general way, or nullptr when not instantiated yet.
+    ASTNodeCache *cache; ///< The cache holding the child lists of real nodes, or nullptr when this node holds its own.
     bool virtualNode; ///< Flag indicating that this node is virtual
-    bool childrenAdded = false; ///< Flag indicating that the child list has been instantiated.
-    bool childrenAccessed = false; ///< Flag indicating that the traversal has entered a child of this ASTNode.
     long ID;
-    
+
 public:
     /// Construct a real ASTNode, representing the given real node.
     /// \param realNode The real AST node encapsulated by this ASTNode
-    ASTNode(DynTypedNode realNode) : node(realNode), virtualNode(false), ID(nextID++) {}
+    /// \param nodeCache The cache to retrieve the child list from, or nullptr to instantiate it in this node.
+    ///                  It must outlive this ASTNode and its copies.
+    ASTNode(DynTypedNode realNode, ASTNodeCache *nodeCache = nullptr) : node(realNode), cache(nodeCache), virtualNode(false), ID(nextID++) {}
     
     /// Construct a virtual ASTNode as a node with a list of children.
     /// \param childList The children of this virtual ASTNode.
-    ASTNode(vector<ASTNode> childList) : children(childList), virtualNode(true), childrenAdded(true), ID(nextID++) {}
+    ASTNode(vector<ASTNode> childList) : children(make_shared<const vector<ASTNode>>(move(childList))), cache(nullptr), virtualNode(true), ID(nextID++) {}
     
     /// Construct a virtual ASTNode without children, i.e. an empty node.
-    ASTNode() : virtualNode(true), childrenAdded(true), ID(nextID++) {}
+    ASTNode() : children(emptyChildList), cache(nullptr), virtualNode(true), ID(nextID++) {}
     
     bool isVirtual() const { return virtualNode; }
     
-    bool areChildrenAccessed() const { return childrenAccessed; }
-    void setChildrenAccessed(bool flag) { childrenAccessed = flag; }
-    
     /// Retrieve the children represented by this ASTNode. If the child list has not been instantiated, this
     /// method will retrieve the children of the underlying node before returning the list.
-    vector<ASTNode> &getChildren();
+    const vector<ASTNode> &getChildren() const;
+    
+    /// Instantiate the child list of a real node.
+    /// \param realNode The node whose children to retrieve.
+    /// \param nodeCache The cache the children will retrieve their own child lists from, if any.
+    static vector<ASTNode> createChildren(const DynTypedNode &realNode, ASTNodeCache *nodeCache);
     
     DynTypedNode &getNode() { return node; }
-    long getID() { return ID; }
-    
-    bool operator==(ASTNode other) { return ID == other.ID; }
-    
-    /// Create an ASTNode from a parent and a child.
-    /// This will create a virtual AST node whose children are all children
-    /// in the given parent node, starting from the child node.
-    /// Children before the given child node are ignored.
-    /// The resulting ASTNode's children will be in the same order as originally.
-    /// \param parent The parent node whose children will become the children of the new ASTNode.
-    /// \param child The first child of parent that will be included in the new ASTNode's children.
-    /// \return A list of new ASTNodes, each containing one more child than the previous.
-    static vector<ASTNode> fromParentAndChild(DynTypedNode &parent, DynTypedNode &child);
+    const DynTypedNode &getNode() const { return node; }
+    long getID() const { return ID; }
+    
+    bool operator==(const ASTNode &other) const { return ID == other.ID; }
+    
+    /// Find the index of a child in the child list of this node.
+    /// \return The index of the child, or the size of the child list if it is not a child of this node.
+    unsigned indexOfChild(const DynTypedNode &child) const;
+    
+    /// Retrieve the structural hash of the subtree rooted at this node, combining hashNode of the node with the
+    /// hashes of its children, in order. Subtrees that match node by node have the same hash.
+    /// The hash of a real node is retrieved from the ASTNodeCache, if the node was created with one.
+    size_t getStructuralHash() const;
+    
+    /// Compute the structural hash of the subtree rooted at this node, without looking it up in the cache.
+    size_t computeStructuralHash() const;
+    
+    /// Retrieve the features of the subtree rooted at this node, computed post-order from the features of its children.
+    /// The features of a real node are retrieved from the ASTNodeCache, if the node was created with one.
+    SubtreeFeatures getFeatures() const;
+    
+    /// Compute the features of the subtree rooted at this node, without looking them up in the cache.
+    SubtreeFeatures computeFeatures() const;
+};
+
+/// \class ASTNodeCache
+/// \brief Side table holding the child lists of the real nodes of one AST.
+/// Each child list is instantiated at most once, the first time the children of any ASTNode representing
+/// that real node are accessed, and is shared by every ASTNode representing it afterwards. This way, the
+/// potential matches in an AST and their copies do not instantiate and copy the same child lists over and over.
+class ASTNodeCache {
+    llvm::DenseMap<const void *, shared_ptr<const vector<ASTNode>>> childLists; ///< Child lists, keyed by the real node
+    llvm::DenseMap<const void *, size_t> structuralHashes; ///< Structural hashes of subtrees, keyed by their real root
+    llvm::DenseMap<const void *, SubtreeFeatures> features; ///< Features of subtrees, keyed by their real root
+
+public:
+    /// Retrieve the child list of a real node, instantiating it if this is the first time it is requested.
+    const shared_ptr<const vector<ASTNode>> &getChildren(const DynTypedNode &realNode);
+    
+    /// Retrieve the structural hash of the subtree rooted at a real node, computing it if this is the first time it is requested.
+    size_t getStructuralHash(const ASTNode &realNode);
+    
+    /// Retrieve the features of the subtree rooted at a real node, computing them if this is the first time they are requested.
+    SubtreeFeatures getFeatures(const ASTNode &realNode);
 };
 
 /// \class ASTTraversalState
 /// \brief Class containing information regarding the state of a traversal in an AST,
 ///        along with some convenience methods.
 /// The initial current node is the first node in the AST.
+/// The traversal may be restricted to a span of the root's children, starting at a given child. When the span
+/// is open-ended, its end is not fixed up front: the traversal may leave the root's child list at any child,
+/// which then becomes the last child of the span.
+/// The path from the root to the current node is kept as a stack of child lists along with the index of the
+/// node on the path in each of them, so moving to a sibling or backtracking to the parent does not need to look
+/// up any node, and copying a traversal state does not copy any ASTNode. The child lists are owned by the root
+/// and its descendants, or by the ASTNodeCache they were retrieved from.
 class ASTTraversalState {
 protected:
+    /// A step on the path down the AST: a child list and the index of the node on the path in that list.
+    struct TraversalFrame {
+        const vector<ASTNode> *siblings;
+        unsigned index;
+    };
+    
     /// The (virtual) root of the AST being traversed
     ASTNode root;
     
-    /// The index of the current node in the child list of the current parent.
-    unsigned currNodeIdx;
+    unsigned spanBegin; ///< The index of the first child of the root in the traversed span
+    unsigned spanEnd; ///< The index of the last child of the root in the traversed span, once the traversal has left it
+    bool openEnded; ///< Whether or not the span may end at any child of the root
     
-    /// A stack of parent ASTNodes representing the path down the AST
-    stack<ASTNode> parents;
+    /// The path down the AST, the last frame contains the current node.
+    llvm::SmallVector<TraversalFrame, 8> path;
     
+    /// Retrieve the current ASTNode.
+    const ASTNode &currentNode() const { return (*path.back().siblings)[path.back().index]; }
+
 public:
     /// Create an ASTTraversalState
     /// \param astRoot The root of the AST to traverse
-    ASTTraversalState(ASTNode astRoot) : root(astRoot), currNodeIdx(0) {
-        astRoot.setChildrenAccessed(true);
-        parents.push(astRoot);
+    ASTTraversalState(ASTNode astRoot) : root(astRoot), spanBegin(0), spanEnd(0), openEnded(false) {
+        path.push_back({ &root.getChildren(), 0 });
+    }
+    
+    /// Create an ASTTraversalState over an open-ended span of the root's children.
+    /// \param astRoot The root whose children to traverse
+    /// \param firstChild The index of the first child of the root to traverse
+    ASTTraversalState(ASTNode astRoot, unsigned firstChild) : root(astRoot), spanBegin(firstChild), spanEnd(firstChild), openEnded(true) {
+        path.push_back({ &root.getChildren(), firstChild });
     }
     
     /// Check if the current ASTNode is the last child of its parent.
     bool isLastChild();
     
+    /// Check if the current ASTNode has a next sibling to proceed to.
+    bool hasNextSibling() { return !isLastChild(); }
+    
+    /// Check if the traversal can backtrack to the parent of the current node, as the last child.
+    /// This is the case for the last child of its parent, and for any child of the root of an open-ended span.
+    bool canEndHere() { return isLastChild() || (openEnded && path.size() == 1); }
+    
     /// Check if the AST traversal has traversed through the whole AST.
     bool astProcessed();
     
     /// Retrieve the current node.
-    DynTypedNode &getCurrent();
+    const DynTypedNode &getCurrent();
     
     /// Traverse to the next sibling of the current node and return it.
     /// Adjust the current node to be the new node.
     /// Will throw an exception when all siblings have been visited.
-    DynTypedNode &nextSibling();
+    const DynTypedNode &nextSibling();
     
     /// Walk back upwards to the parent of the current node.
     /// Adjusts the current node to be the parent.
-    DynTypedNode &backtrackToParent();
+    void backtrackToParent();
     
     /// Descend down the AST to the first child of the current node.
     /// Adjusts the current node to be the child.
     /// Will throw an exception if it does not have any children.
-    DynTypedNode &descendToChild();
+    const DynTypedNode &descendToChild();
     
     /// Check if the current node has children.
     bool hasChildren();
     
-    /// Check if we've descended into the current node's children yet.
-    bool childrenAccessed();
+    long getID() { return currentNode().getID(); }
+    
+    /// Retrieve the structural hash of the subtree rooted at the current node.
+    size_t getCurrentHash() { return currentNode().getStructuralHash(); }
     
-    long getID() { return parents.top().getChildren()[currNodeIdx].getID(); }
+    /// Retrieve the features of the subtree rooted at the current node.
+    SubtreeFeatures getCurrentFeatures() { return currentNode().getFeatures(); }
 };
 
 /// \class PotentialMatch
@@ -154,31 +257,101 @@ public:
 /// It derives ASTTraversalState in order to facilitate moving through the potential match.
 /// It keeps a pointer to the AST unit that owns the potential match, in order to allow
 /// potential matches to be grouped by AST unit later on.
+///
+/// Metavariable instantiations are recorded as positions in a child list while matching, and are only turned
+/// into ASTNodes once the potential match has matched, see bindMetavariables. A checkpoint of the potential match
+/// can be restored to try another instantiation, without copying the potential match up front.
 class PotentialMatch : public ASTTraversalState {
+    /// An instantiation of a metavariable: a sequence of siblings, or a single node
+    struct MetavariableBinding {
+        const Metavariable *meta;
+        const vector<ASTNode> *siblings;
+        unsigned first;
+        unsigned last;
+        bool span; ///< Whether or not the siblings are instantiated as a virtual node, even if it is a single one
+    };
+    
+    vector<MetavariableBinding> bindings; ///< The instantiations recorded while matching, in order
     map<Metavariable, ASTNode> metavarInstantiations; ///< A map containing the instantiations for metavariables for a potential match
     shared_ptr<ASTUnit> owningAST; ///< A pointer to the AST that owns this potential match.
-    
+
 public:
-    PotentialMatch(ASTNode root, shared_ptr<ASTUnit> owner) : ASTTraversalState(root), owningAST(owner) {}
+    /// \struct Checkpoint
+    /// \brief The state of a potential match at some point while matching it.
+    struct Checkpoint {
+        llvm::SmallVector<TraversalFrame, 8> path;
+        unsigned spanEnd;
+        size_t bindingCount;
+    };
+    
+    /// Create a potential match for the siblings starting at a child of a parent node.
+    /// \param parent The parent node
+    /// \param firstChild The index of the first child of the parent that is part of the potential match
+    /// \param owner The AST that owns the potential match
+    PotentialMatch(ASTNode parent, unsigned firstChild, shared_ptr<ASTUnit> owner)
+        : ASTTraversalState(parent, firstChild), owningAST(owner) {}
     
-    /// Retrieve a list of AST subtrees that make up the match
+    /// Retrieve a list of AST subtrees that make up the match, i.e. the span of siblings it was matched on.
+    /// Only valid once the traversal has backtracked out of the span.
     vector<DynTypedNode> getMatchRoot();
     
-    /// Retrieve the metavariable mappings
+    /// Retrieve the metavariable mappings. Only valid once bindMetavariables has been called.
     map<Metavariable, ASTNode> &getMetavariables() { return metavarInstantiations; }
     
+    /// Check if a node satisfies the kind and type constraints of a metavariable.
+    static bool satisfiesConstraints(const Metavariable &meta, const ASTNode &node);
+    
     /// Take the current node in the AST traversal and instantiate it as the given metavariable.
-    void instantiateCurrentAsMetavariable(Metavariable &meta);
+    /// The metavariable must outlive the potential match, until bindMetavariables has been called.
+    /// \return Whether or not the node satisfies the constraints of the metavariable, it is not instantiated if it doesn't.
+    bool instantiateCurrentAsMetavariable(const Metavariable &meta);
+    
+    /// Instantiate the sequence of siblings starting at the current node as the given metavariable, and make the
+    /// last of them the current node. The metavariable must outlive the potential match, until bindMetavariables
+    /// has been called.
+    /// \param length The number of siblings to instantiate.
+    /// \param checked The number of leading siblings already known to satisfy the constraints of the metavariable.
+    /// \return Whether or not there are enough siblings and they satisfy the constraints of the metavariable.
+    ///         The potential match is left unchanged if not.
+    bool instantiateSpanAsMetavariable(const Metavariable &meta, unsigned length, unsigned checked = 0);
+    
+    /// Turn the recorded instantiations into the metavariable mappings. When a metavariable is instantiated
+    /// multiple times, the first instantiation is kept.
+    void bindMetavariables();
+    
+    /// Take a checkpoint of the traversal and the instantiations recorded so far.
+    Checkpoint checkpoint() const { return { path, spanEnd, bindings.size() }; }
     
-    /// Take the current node in the AST traversal and create new potential matches with the
-    /// given metavariable instantiated. As metavariable instantiations may span multiple AST nodes,
-    /// we create new potential matches for each possible sequence of subtrees the metavariable
-    /// could instantiate. New potential matches are added to the passed vector.
-    void extendForMetavariable(Metavariable &meta, vector<PotentialMatch> &potentials);
+    /// Return to a checkpoint taken earlier on this potential match, undoing the instantiations recorded since.
+    void restore(const Checkpoint &cp);
     
     /// Retrieve the owning AST of this potential match.
     shared_ptr<ASTUnit> getOwner() { return owningAST; }
 };
+
+/// \class MetavariableSplits
+/// \brief Resumable enumeration of the instantiations of a fully parameterized metavariable, starting at the
+/// current node of a potential match, shortest first. Only instantiations within the metavariable's minNodes
+/// and maxNodes are produced, and the enumeration ends at the first sibling violating its kind or type constraints.
+/// The enumeration is a state machine rather than a list: each instantiation is only produced once the previous
+/// one has failed, by returning the potential match to the checkpoint the enumeration started at and extending
+/// the instantiation by one sibling. Memory use does not depend on the number of siblings.
+class MetavariableSplits {
+    const Metavariable *meta;
+    PotentialMatch::Checkpoint start; ///< The potential match right before the first instantiation
+    unsigned length; ///< The number of siblings in the last instantiation produced, 0 before the first one
+
+public:
+    /// Start enumerating the instantiations of a metavariable at the current node of a potential match.
+    /// The metavariable must outlive the enumeration.
+    MetavariableSplits(const Metavariable &metavariable, const PotentialMatch &pot)
+        : meta(&metavariable), start(pot.checkpoint()), length(0) {}
+    
+    /// Instantiate the metavariable in the potential match with the next instantiation, undoing everything
+    /// that happened to the potential match since the previous one.
+    /// \return Whether or not there was a next instantiation. If not, the potential match is returned to the start.
+    bool next(PotentialMatch &pot);
+};
     
 } // namespace X
 
@@ -8,6 +8,8 @@
 
 #include "LHSComparators.hpp"
 
+#include <llvm/ADT/Hashing.h>
+
 using namespace X;
 
 //
@@ -161,24 +163,74 @@ COMPARE(UnaryOperator, {
     return left->getOpcode() == right->getOpcode();
 })
 
+#define RESOLVE(NodeKind) if (NodeKind##Class.isBaseOf(templNodeKind)) return compare##NodeKind
+
+Comparator X::resolveComparator(ASTNodeKind templNodeKind) {
+    // Further checks are needed for certain node types
+    if (StmtClass.isBaseOf(templNodeKind)) {
+        RESOLVE(BinaryOperator);
+        RESOLVE(CharacterLiteral);
+        RESOLVE(CXXBoolLiteralExpr);
+        RESOLVE(DeclRefExpr);
+        RESOLVE(FloatingLiteral);
+        RESOLVE(IntegerLiteral);
+        RESOLVE(MemberExpr);
+        RESOLVE(StringLiteral);
+        RESOLVE(UnaryOperator);
+    } else RESOLVE(Decl);
+    
+    return nullptr;
+}
+
 bool X::compare(DynTypedNode templNode, DynTypedNode potMatchNode, bool nameOnly) {
     ASTNodeKind templNodeKind(templNode.getNodeKind());
     
     // At least the node kind must be the same.
     if (!templNodeKind.isSame(potMatchNode.getNodeKind()) && !templNodeKind.isNone() && !potMatchNode.getNodeKind().isNone()) return false;
     
-    // Further checks are needed for certain node types
-    if (StmtClass.isBaseOf(templNodeKind)) {
-        EXTRA_CHECK(BinaryOperator);
-        EXTRA_CHECK(CharacterLiteral);
-        EXTRA_CHECK(CXXBoolLiteralExpr);
-        EXTRA_CHECK(DeclRefExpr);
-        EXTRA_CHECK(FloatingLiteral);
-        EXTRA_CHECK(IntegerLiteral);
-        EXTRA_CHECK(MemberExpr);
-        EXTRA_CHECK(StringLiteral);
-        EXTRA_CHECK(UnaryOperator);
-    } else EXTRA_CHECK(Decl);
+    Comparator comparator(resolveComparator(templNodeKind));
+    return !comparator || comparator(templNode, potMatchNode, nameOnly);
+}
+
+bool X::getValueKey(const DynTypedNode &node, std::string &key) {
+    if (const IntegerLiteral *literal = node.get<IntegerLiteral>()) {
+        key = literal->getValue().toString(10, false);
+    } else if (const CharacterLiteral *literal = node.get<CharacterLiteral>()) {
+        key = std::to_string(literal->getValue());
+    } else if (const CXXBoolLiteralExpr *literal = node.get<CXXBoolLiteralExpr>()) {
+        key = literal->getValue() ? "true" : "false";
+    } else if (const StringLiteral *literal = node.get<StringLiteral>()) {
+        key = literal->getBytes();
+    } else if (const BinaryOperator *op = node.get<BinaryOperator>()) {
+        key = BinaryOperator::getOpcodeStr(op->getOpcode());
+    } else if (const UnaryOperator *op = node.get<UnaryOperator>()) {
+        key = UnaryOperator::getOpcodeStr(op->getOpcode());
+    } else if (const DeclRefExpr *ref = node.get<DeclRefExpr>()) {
+        key = ref->getDecl()->getNameAsString();
+    } else if (const MemberExpr *member = node.get<MemberExpr>()) {
+        key = member->getMemberDecl()->getNameAsString();
+    } else if (const NamedDecl *decl = node.get<NamedDecl>()) {
+        key = decl->getNameAsString();
+    } else {
+        return false;
+    }
     
     return true;
 }
+
+size_t X::hashNode(const DynTypedNode &node) {
+    llvm::hash_code hash(0);
+    if (const Stmt *stmt = node.get<Stmt>()) {
+        hash = llvm::hash_combine(0, stmt->getStmtClass());
+    } else if (const Decl *decl = node.get<Decl>()) {
+        hash = llvm::hash_combine(1, decl->getKind(), decl->getAccess());
+        if (const ValueDecl *value = dyn_cast<ValueDecl>(decl)) {
+            QualType type(value->getType());
+            hash = llvm::hash_combine(hash, type.getQualifiers().getAsOpaqueValue(), type->getTypeClass());
+        }
+    }
+    
+    std::string key;
+    if (getValueKey(node, key)) hash = llvm::hash_combine(hash, key);
+    return hash;
+}
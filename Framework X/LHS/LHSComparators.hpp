@@ -17,6 +17,8 @@
 
 #include <llvm/ADT/APFloat.h>
 
+#include <string>
+
 using namespace clang;
 using namespace clang::ast_type_traits;
 
@@ -25,6 +27,24 @@ namespace X {
 /// Compare a template node to a potential match node, return true if they match, false otherwise.
 /// If the third argument is true, the matching will ignore differences in name.
 extern bool compare(DynTypedNode templNode, DynTypedNode potMatchNode, bool nameOnly = false);
+
+/// A function comparing the properties of a template node to those of a potential match node of the same kind.
+typedef bool (*Comparator)(const DynTypedNode &templNode, const DynTypedNode &potMatchNode, bool nameOnly);
+
+/// Retrieve the function comparing the properties of template nodes of the given kind, i.e. the one used by
+/// compare after checking the node kinds. Returns nullptr when nodes of this kind only need to be of the same kind.
+extern Comparator resolveComparator(ASTNodeKind templNodeKind);
+
+/// Retrieve a key for the value compared by the comparator of a node, such as the value of a literal, the name of a
+/// declaration or of the declaration a reference refers to, or the opcode of an operator. Two nodes of the same kind
+/// for which compare returns true, without ignoring names, have the same key. Nodes with a different key never match.
+/// \return Whether or not nodes of this kind have a value key.
+extern bool getValueKey(const DynTypedNode &node, std::string &key);
+
+/// Hash the properties of a node checked by compare, without its children: its kind, access, value key and,
+/// for declarations with a type, the qualifiers and class of that type. Two nodes for which compare returns true,
+/// without ignoring names, have the same hash.
+extern size_t hashNode(const DynTypedNode &node);
     
 } // namespace X
 
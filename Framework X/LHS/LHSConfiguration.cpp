@@ -45,6 +45,25 @@ static void validateRangeConstraints(TemplateRange &templateRange, vector<Metava
     }
 }
 
+/// Look up a Decl or Stmt node kind by the name of its class, e.g. "CallExpr" or "FunctionDecl".
+/// \return The node kind, or the none kind if there is no such class.
+static clang::ast_type_traits::ASTNodeKind getNodeKindFromName(const string &name) {
+    using clang::ast_type_traits::ASTNodeKind;
+    static const map<string, ASTNodeKind> kindsByName = {
+        { "Decl", ASTNodeKind::getFromNodeKind<clang::Decl>() },
+        { "Stmt", ASTNodeKind::getFromNodeKind<clang::Stmt>() },
+#define DECL(DERIVED, BASE) { #DERIVED "Decl", ASTNodeKind::getFromNodeKind<clang::DERIVED##Decl>() },
+#define ABSTRACT_DECL(D) D
+#include <clang/AST/DeclNodes.inc>
+#define STMT(CLASS, PARENT) { #CLASS, ASTNodeKind::getFromNodeKind<clang::CLASS>() },
+#define ABSTRACT_STMT(S) S
+#include <clang/AST/StmtNodes.inc>
+    };
+    
+    auto it(kindsByName.find(name));
+    return it != kindsByName.end() ? it->second : ASTNodeKind();
+}
+
 /// Parse and validate the JSON configuration
 /// Throws an exception on invalid JSON files
 static json parseAndValidate(string configPath) {
@@ -134,6 +153,26 @@ LHSConfiguration::LHSConfiguration(string jsonCfgPath) {
         if (kv.find("nameOnly") != kv.end()) {
             meta.nameOnly = kv["nameOnly"];
         }
+        if (kv.find("minNodes") != kv.end()) {
+            meta.minNodes = kv["minNodes"];
+        }
+        if (kv.find("maxNodes") != kv.end()) {
+            meta.maxNodes = kv["maxNodes"];
+            if (meta.maxNodes < meta.minNodes)
+                throw MalformedConfigException("Metavariable " + meta.identifier + " has a maxNodes smaller than its minNodes");
+        }
+        if (kv.find("kinds") != kv.end()) {
+            for (auto &jKind : kv["kinds"]) {
+                string name(jKind.get<string>());
+                auto kind(getNodeKindFromName(name));
+                if (kind.isNone())
+                    throw MalformedConfigException("Unknown node kind " + name + " for metavariable " + meta.identifier);
+                meta.kinds.push_back(kind);
+            }
+        }
+        if (kv.find("type") != kv.end()) {
+            meta.typePattern = kv["type"].get<string>();
+        }
         metavariableRanges.push_back(meta);
     }
     
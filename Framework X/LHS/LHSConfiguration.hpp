@@ -12,6 +12,7 @@
 #include <string>
 #include <utility>
 #include <map>
+#include <vector>
 #include <fstream>
 #include <iostream>
 #include <stdexcept>
@@ -20,6 +21,7 @@
 #include <llvm/ADT/SmallVector.h>
 #include <clang/Basic/VirtualFileSystem.h>
 #include <clang/Basic/SourceManager.h>
+#include <clang/AST/ASTTypeTraits.h>
 
 #include <json.hpp>
 #include <json-schema.hpp>
@@ -166,6 +168,10 @@ class Metavariable {
 public:
     string identifier;
     bool nameOnly = false; ///< Indicates that for NamedDecl nodes, only the name is parameterized, not the type.
+    unsigned minNodes = 1; ///< The minimum number of sibling nodes a fully parameterized metavariable instantiates.
+    unsigned maxNodes = 0; ///< The maximum number of sibling nodes a fully parameterized metavariable instantiates, 0 when unbounded.
+    vector<clang::ast_type_traits::ASTNodeKind> kinds; ///< The kinds of nodes, or their bases, the metavariable may instantiate, any kind when empty.
+    string typePattern; ///< The pattern the types of instantiated expressions must match, where * matches any sequence of characters, any type when empty.
     
     Metavariable(string id) : identifier(id) {}
     
@@ -0,0 +1,362 @@
+//
+//  LHSMatchProgram.cpp
+//  Framework X
+//
+//  Created by Ruben Opdebeeck on 16/06/2017.
+//  Copyright © 2017 Ruben Opdebeeck. All rights reserved.
+//
+
+#include "LHSMatchProgram.hpp"
+
+#include <clang/AST/RecursiveASTVisitor.h>
+
+using namespace X;
+
+/// \class TraversalParentCollector
+/// \brief Helper class recording the parent of every node in a template subtree, in a traversal like the one
+/// of ASTIndexBuilder. Nodes that traversal skips, such as implicit declarations, are not recorded.
+class TraversalParentCollector : public RecursiveASTVisitor<TraversalParentCollector> {
+    llvm::DenseMap<const void *, const void *> &parents;
+    llvm::SmallVector<const void *, 32> traversalPath;
+    
+    void record(const void *node) {
+        parents[node] = traversalPath.empty() ? nullptr : traversalPath.back();
+    }
+
+public:
+    TraversalParentCollector(llvm::DenseMap<const void *, const void *> &p) : parents(p) {}
+    
+    bool TraverseStmt(Stmt *S) {
+        if (!S) return true;
+        
+        record(S);
+        traversalPath.push_back(S);
+        bool result = RecursiveASTVisitor<TraversalParentCollector>::TraverseStmt(S);
+        traversalPath.pop_back();
+        return result;
+    }
+    
+    bool TraverseDecl(Decl *D) {
+        if (!D || (!shouldVisitImplicitCode() && D->isImplicit())) return true;
+        
+        record(D);
+        traversalPath.push_back(D);
+        bool result = RecursiveASTVisitor<TraversalParentCollector>::TraverseDecl(D);
+        traversalPath.pop_back();
+        return result;
+    }
+};
+
+LHSMatchProgram::LHSMatchProgram(const vector<DynTypedNode> &subtrees, const map<DynTypedNode, Metavariable> &metas) {
+    // The template subtrees are the children of a virtual root, just like the subtrees of a potential match
+    vector<ASTNode> roots;
+    TraversalParentCollector collector(traversalParents);
+    for (auto &subtree : subtrees) {
+        roots.push_back(ASTNode(subtree));
+        if (const Stmt *stmt = subtree.get<Stmt>()) collector.TraverseStmt(const_cast<Stmt *>(stmt));
+        else if (const Decl *decl = subtree.get<Decl>()) collector.TraverseDecl(const_cast<Decl *>(decl));
+    }
+    
+    vector<AnchorStep> path;
+    compileSiblings(roots, nullptr, metas, &path, false);
+    instructions.push_back(MatchInstruction(MATCH));
+    traversalParents.clear();
+}
+
+bool LHSMatchProgram::canBeAnchor(const ASTNode &node, const ASTNode *parent) const {
+    if (node.isVirtual()) return false;
+    
+    // Nodes expanded from a macro in the template may be written differently in the source files
+    if (node.getNode().getSourceRange().getBegin().isMacroID()) return false;
+    
+    // The parent in the traversal must be the parent in the child lists, to walk up from a node in the index
+    auto it(traversalParents.find(node.getNode().getMemoizationData()));
+    if (it == traversalParents.end()) return false;
+    return parent ? it->second == parent->getNode().getMemoizationData() : it->second == nullptr;
+}
+
+/// Check if a template subtree does not contain any metavariables, in which case it matches node by node.
+static bool isMetavariableFree(const ASTNode &node, const map<DynTypedNode, Metavariable> &metas) {
+    if (!node.isVirtual() && metas.find(node.getNode()) != metas.end()) return false;
+    
+    for (const ASTNode &child : node.getChildren()) {
+        if (!isMetavariableFree(child, metas)) return false;
+    }
+    return true;
+}
+
+/// Compute the features a subtree must have to match a template subtree.
+/// Fully parameterized metavariables instantiate at least minNodes nodes, of any kind.
+static SubtreeFeatures getRequiredFeatures(const ASTNode &node, const map<DynTypedNode, Metavariable> &metas) {
+    SubtreeFeatures required(SubtreeFeatures::ofNode(node));
+    const vector<ASTNode> &children(node.getChildren());
+    for (unsigned i = 0; i < children.size(); i++) {
+        auto metaIt(children[i].isVirtual() ? metas.end() : metas.find(children[i].getNode()));
+        if (metaIt == metas.end() || metaIt->second.nameOnly) {
+            required.addChild(getRequiredFeatures(children[i], metas));
+            continue;
+        }
+        
+        // The following siblings that are part of the same metavariable are instantiated together
+        for (unsigned n = 0; n < max(metaIt->second.minNodes, 1u); n++) {
+            required.addChild(SubtreeFeatures());
+        }
+        while (i + 1 < children.size()) {
+            auto nextIt(children[i + 1].isVirtual() ? metas.end() : metas.find(children[i + 1].getNode()));
+            if (nextIt == metas.end() || nextIt->second.identifier != metaIt->second.identifier) break;
+            i++;
+        }
+    }
+    
+    return required;
+}
+
+/// Compute the positions of template siblings in a matching child list, counted from its start and from its end.
+/// A fully parameterized metavariable takes up minNodes siblings if that equals its maxNodes, and an unknown number
+/// otherwise. The siblings after it have no position counted from the start, the ones before it none counted from the end.
+/// \param fromStart Set to the number of siblings before each template sibling, or -1 if it's not fixed.
+/// \param fromEnd Set to the number of siblings after each template sibling, or -1 if it's not fixed.
+static void computeSiblingPositions(const vector<ASTNode> &siblings, const map<DynTypedNode, Metavariable> &metas,
+                                    vector<int> &fromStart, vector<int> &fromEnd) {
+    // The number of siblings each template sibling takes up, siblings that are part of the previous metavariable take up none
+    vector<int> width(siblings.size(), 1);
+    const Metavariable *prevMeta(nullptr);
+    for (unsigned i = 0; i < siblings.size(); i++) {
+        auto metaIt(siblings[i].isVirtual() ? metas.end() : metas.find(siblings[i].getNode()));
+        const Metavariable *meta(metaIt != metas.end() && !metaIt->second.nameOnly ? &metaIt->second : nullptr);
+        
+        if (meta && prevMeta && meta->identifier == prevMeta->identifier) width[i] = 0;
+        else if (meta) width[i] = meta->maxNodes != 0 && meta->minNodes == meta->maxNodes ? meta->maxNodes : -1;
+        prevMeta = meta;
+    }
+    
+    fromStart.assign(siblings.size(), -1);
+    fromEnd.assign(siblings.size(), -1);
+    for (int i = 0, offset = 0; i < (int)siblings.size() && offset >= 0; i++) {
+        fromStart[i] = offset;
+        offset = width[i] < 0 ? -1 : offset + width[i];
+    }
+    for (int i = (int)siblings.size() - 1, offset = 0; i >= 0 && offset >= 0; i--) {
+        fromEnd[i] = offset;
+        offset = width[i] < 0 ? -1 : offset + width[i];
+    }
+}
+
+void LHSMatchProgram::emitMetavariable(MatchOpcode opcode, const Metavariable &meta) {
+    MatchInstruction instruction(opcode);
+    instruction.metavariable = metavariables.size();
+    metavariables.push_back(meta);
+    instructions.push_back(instruction);
+}
+
+void LHSMatchProgram::compileSiblings(const vector<ASTNode> &siblings, const ASTNode *parent, const map<DynTypedNode, Metavariable> &metas,
+                                      vector<AnchorStep> *path, bool hashed) {
+    vector<int> fromStart, fromEnd;
+    if (path) computeSiblingPositions(siblings, metas, fromStart, fromEnd);
+    
+    for (unsigned i = 0; i < siblings.size(); i++) {
+        const ASTNode &curr(siblings[i]);
+        auto metaIt(curr.isVirtual() ? metas.end() : metas.find(curr.getNode()));
+        
+        // A fully parameterized metavariable may instantiate multiple nodes, its children are not matched
+        if (metaIt != metas.end() && !metaIt->second.nameOnly) {
+            const Metavariable &meta(metaIt->second);
+            emitMetavariable(SPAN_META, meta);
+            
+            if (i + 1 == siblings.size()) {
+                instructions.push_back(MatchInstruction(ASCEND));
+                return;
+            }
+            instructions.push_back(MatchInstruction(NEXT_SIBLING));
+            
+            // Skip the following template siblings that are part of the same metavariable
+            while (i + 1 < siblings.size()) {
+                auto nextIt(siblings[i + 1].isVirtual() ? metas.end() : metas.find(siblings[i + 1].getNode()));
+                if (nextIt == metas.end() || nextIt->second.identifier != meta.identifier) break;
+                
+                if (++i + 1 == siblings.size()) {
+                    instructions.push_back(MatchInstruction(ASCEND));
+                    return;
+                }
+            }
+            continue;
+        }
+        
+        // Reject subtrees without metavariables by their structural hash first, only compare them node by node on a hit
+        bool hashCurr(!hashed && !curr.getChildren().empty() && isMetavariableFree(curr, metas));
+        if (hashCurr) {
+            MatchInstruction checkHash(CHECK_HASH);
+            checkHash.hash = curr.computeStructuralHash();
+            instructions.push_back(checkHash);
+        }
+        
+        // Subtrees with metavariables are rejected when they are too small or miss a required kind
+        else if (!hashed && !curr.getChildren().empty()) {
+            MatchInstruction checkFeatures(CHECK_FEATURES);
+            checkFeatures.features = getRequiredFeatures(curr, metas);
+            instructions.push_back(checkFeatures);
+        }
+        
+        // Compare the node itself, name-only metavariables ignore differences in name
+        bool nameOnly(metaIt != metas.end());
+        ASTNodeKind kind(curr.getNode().getNodeKind());
+        // Position the node from the start of its siblings, or from their end when it follows a metavariable
+        AnchorStep step{ 0, false };
+        bool anchored(path && canBeAnchor(curr, parent));
+        if (anchored && fromStart[i] >= 0) step = { (unsigned)fromStart[i], false };
+        else if (anchored && fromEnd[i] >= 0 && !path->empty()) step = { (unsigned)fromEnd[i], true };
+        else anchored = false;
+        
+        if (anchored) {
+            MatchAnchor anchor;
+            anchor.kind = kind;
+            anchor.hasValue = !nameOnly && getValueKey(curr.getNode(), anchor.value);
+            anchor.path = *path;
+            anchor.path.push_back(step);
+            anchors.push_back(anchor);
+        }
+        if (!kind.isNone()) {
+            MatchInstruction checkKind(CHECK_KIND);
+            checkKind.kind = kind;
+            instructions.push_back(checkKind);
+        }
+        if (Comparator comparator = resolveComparator(kind)) {
+            MatchInstruction checkNode(CHECK_NODE);
+            checkNode.node = curr.getNode();
+            checkNode.comparator = comparator;
+            checkNode.nameOnly = nameOnly;
+            instructions.push_back(checkNode);
+        }
+        if (nameOnly) {
+            emitMetavariable(BIND_NAME_ONLY, metaIt->second);
+        }
+        
+        // Match the children, if any
+        if (curr.getChildren().empty()) {
+            instructions.push_back(MatchInstruction(CHECK_LEAF));
+        } else {
+            instructions.push_back(MatchInstruction(DESCEND));
+            if (anchored) path->push_back(step);
+            compileSiblings(curr.getChildren(), &curr, metas, anchored ? path : nullptr, hashed || hashCurr);
+            if (anchored) path->pop_back();
+        }
+        
+        instructions.push_back(MatchInstruction(i + 1 == siblings.size() ? ASCEND : NEXT_SIBLING));
+    }
+}
+
+bool LHSMatchProgram::run(PotentialMatch &candidate) const {
+    if (instructions.empty()) return false;
+    
+    vector<ChoicePoint> choices;
+    size_t pc(0);
+    do {
+        if (execute(pc, candidate, choices)) {
+            candidate.bindMetavariables();
+            return true;
+        }
+    } while (backtrack(candidate, choices, pc));
+    
+    return false;
+}
+
+bool LHSMatchProgram::backtrack(PotentialMatch &pot, vector<ChoicePoint> &choices, size_t &pc) const {
+    // Once a choice point runs out of instantiations, the one before it is resumed instead
+    while (!choices.empty()) {
+        if (choices.back().splits.next(pot)) {
+            pc = choices.back().pc + 1;
+            return true;
+        }
+        choices.pop_back();
+    }
+    
+    return false;
+}
+
+bool LHSMatchProgram::execute(size_t pc, PotentialMatch &pot, vector<ChoicePoint> &choices) const {
+    for (;; pc++) {
+        const MatchInstruction &instruction(instructions[pc]);
+        
+        switch (instruction.opcode) {
+            case CHECK_FEATURES:
+                if (!pot.getCurrentFeatures().satisfies(instruction.features)) return false;
+                break;
+            
+            case CHECK_HASH:
+                if (pot.getCurrentHash() != instruction.hash) return false;
+                break;
+            
+            case CHECK_KIND: {
+                ASTNodeKind kind(pot.getCurrent().getNodeKind());
+                if (!kind.isNone() && !instruction.kind.isSame(kind)) return false;
+                break;
+            }
+            
+            case CHECK_NODE:
+                if (!instruction.comparator(instruction.node, pot.getCurrent(), instruction.nameOnly)) return false;
+                break;
+            
+            case CHECK_LEAF:
+                if (pot.hasChildren()) return false;
+                break;
+            
+            case DESCEND:
+                if (!pot.hasChildren()) return false;
+                pot.descendToChild();
+                break;
+            
+            case NEXT_SIBLING:
+                if (!pot.hasNextSibling()) return false;
+                pot.nextSibling();
+                break;
+            
+            case ASCEND:
+                if (!pot.canEndHere()) return false;
+                pot.backtrackToParent();
+                break;
+            
+            case BIND_NAME_ONLY:
+                if (!pot.instantiateCurrentAsMetavariable(metavariables[instruction.metavariable])) return false;
+                break;
+            
+            case SPAN_META:
+                // Continue with the first instantiation, the others are only produced when backtracking
+                choices.push_back({ pc, MetavariableSplits(metavariables[instruction.metavariable], pot) });
+                if (!choices.back().splits.next(pot)) {
+                    choices.pop_back();
+                    return false;
+                }
+                break;
+            
+            case MATCH:
+                return true;
+        }
+    }
+}
+
+void LHSMatchProgram::dump(llvm::raw_ostream &out) const {
+    static const char *opcodeNames[] = {
+        "CHECK_FEATURES", "CHECK_HASH", "CHECK_KIND", "CHECK_NODE", "CHECK_LEAF", "DESCEND", "NEXT_SIBLING", "ASCEND", "BIND_NAME_ONLY", "SPAN_META", "MATCH"
+    };
+    
+    for (size_t pc = 0; pc < instructions.size(); pc++) {
+        const MatchInstruction &instruction(instructions[pc]);
+        out << pc << "\t" << opcodeNames[instruction.opcode];
+        
+        switch (instruction.opcode) {
+            case CHECK_FEATURES:
+                out << " nodes>=" << instruction.features.nodeCount << " height>=" << instruction.features.height
+                    << " children>=" << instruction.features.childCount << " kinds=";
+                out.write_hex(instruction.features.kindBloom);
+                break;
+            case CHECK_HASH: out << " "; out.write_hex(instruction.hash); break;
+            case CHECK_KIND: out << " " << instruction.kind.asStringRef(); break;
+            case CHECK_NODE: out << " " << instruction.node.getNodeKind().asStringRef() << (instruction.nameOnly ? " [name-only]" : ""); break;
+            case BIND_NAME_ONLY:
+            case SPAN_META: out << " " << metavariables[instruction.metavariable].identifier; break;
+            default: break;
+        }
+        
+        out << "\n";
+    }
+}
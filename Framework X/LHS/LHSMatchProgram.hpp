@@ -0,0 +1,157 @@
+//
+//  LHSMatchProgram.hpp
+//  Framework X
+//
+//  Created by Ruben Opdebeeck on 16/06/2017.
+//  Copyright © 2017 Ruben Opdebeeck. All rights reserved.
+//
+
+#ifndef LHSMatchProgram_hpp
+#define LHSMatchProgram_hpp
+
+#include <vector>
+#include <map>
+#include <string>
+
+#include <clang/AST/ASTTypeTraits.h>
+#include <llvm/ADT/DenseMap.h>
+#include <llvm/Support/raw_ostream.h>
+
+#include "ASTTraversalState.hpp"
+#include "LHSComparators.hpp"
+#include "LHSConfiguration.hpp"
+
+using namespace clang::ast_type_traits;
+using namespace clang;
+using namespace std;
+
+namespace X {
+
+/// The operations a compiled LHS template consists of.
+/// Each operation either checks the current node of a potential match, or moves the potential match's traversal.
+/// When an operation fails, the potential match does not match the template.
+enum MatchOpcode {
+    CHECK_FEATURES, ///< The subtree rooted at the current node must satisfy the instruction's features
+    CHECK_HASH,     ///< The subtree rooted at the current node must have the instruction's structural hash
+    CHECK_KIND,     ///< The current node must be of the instruction's kind
+    CHECK_NODE,     ///< The current node's properties must be equal to those of the instruction's template node
+    CHECK_LEAF,     ///< The current node must not have children
+    DESCEND,        ///< Descend to the first child of the current node, which must have children
+    NEXT_SIBLING,   ///< Proceed to the next sibling of the current node, which must not be the last child
+    ASCEND,         ///< Backtrack to the parent of the current node, which must be the last child, or end the span of a candidate root
+    BIND_NAME_ONLY, ///< Instantiate the current node as a name-only metavariable
+    SPAN_META,      ///< Instantiate a sequence of siblings, starting at the current node, as a metavariable
+    MATCH           ///< The potential match matches the template
+};
+
+/// \struct MatchInstruction
+/// \brief A single instruction of a compiled LHS template.
+struct MatchInstruction {
+    MatchOpcode opcode;
+    ASTNodeKind kind; ///< The kind to check, for CHECK_KIND
+    size_t hash = 0; ///< The structural hash of the template subtree, for CHECK_HASH
+    SubtreeFeatures features; ///< The features required by the template subtree, for CHECK_FEATURES
+    DynTypedNode node; ///< The template node to compare to, for CHECK_NODE
+    Comparator comparator = nullptr; ///< The resolved comparator of the template node, for CHECK_NODE
+    bool nameOnly = false; ///< Whether or not CHECK_NODE should ignore differences in name
+    unsigned metavariable = 0; ///< The index of the metavariable to instantiate, for BIND_NAME_ONLY and SPAN_META
+    
+    MatchInstruction(MatchOpcode op) : opcode(op) {}
+};
+
+/// \struct AnchorStep
+/// \brief The position of a node on the path of an anchor in the child list of its parent.
+struct AnchorStep {
+    unsigned offset; ///< The number of siblings before the node, or after it if fromEnd is set
+    bool fromEnd;
+};
+
+/// \struct MatchAnchor
+/// \brief A template node candidates can be looked up by, as it is always at the same position relative to the
+/// start of a match. That is, the node is not a fully parameterized metavariable, and no node on its path is virtual.
+/// On every level of its path, the node on the path is either only preceded, or only followed, by fully parameterized
+/// metavariables instantiating a fixed number of nodes, i.e. their minNodes equal their maxNodes. The template subtrees
+/// are the exception: the end of a match is not known up front, so they can't be positioned from the end.
+/// The node and every node on its path are traversed by the ASTIndex, with the node's parent in the child lists as their
+/// parent in the traversal, and the node is not expanded from a macro. Every node matching an anchor is therefore in the
+/// index, as are its ancestors in the main file, and walking up from it along their entries retraces the anchor's path.
+struct MatchAnchor {
+    ASTNodeKind kind;
+    bool hasValue = false; ///< Whether or not matching nodes must have the value key value, see getValueKey
+    string value;
+    
+    /// The position of the node: its offset from the first template subtree, followed by the position of each
+    /// node on its path in the child list of its parent
+    vector<AnchorStep> path;
+};
+
+/// \class LHSMatchProgram
+/// \brief A LHS template compiled to a linear sequence of instructions.
+/// The program is compiled once from the template subtrees, resolving metavariables and comparators up front,
+/// and executed against each potential match. Running a potential match walks it in the same order as the
+/// template was compiled in, without inspecting the template itself.
+class LHSMatchProgram {
+    vector<MatchInstruction> instructions;
+    vector<Metavariable> metavariables; ///< The metavariables instantiated by the program, indexed by the instructions
+    vector<MatchAnchor> anchors; ///< The template nodes candidates can be looked up by, in template order
+    
+    /// The parent of every template node in a traversal like the one building an ASTIndex, nullptr for the template subtrees.
+    /// Only used while compiling.
+    llvm::DenseMap<const void *, const void *> traversalParents;
+    
+    /// Emit the instructions matching a list of template siblings, ending with the move out of the list.
+    /// \param parent The parent of the siblings, or nullptr for the template subtrees.
+    /// \param path The path of the siblings' parent, as in MatchAnchor, or nullptr if the siblings can't be anchors.
+    /// \param hashed Whether or not the siblings are part of a subtree whose structural hash is already checked.
+    void compileSiblings(const vector<ASTNode> &siblings, const ASTNode *parent, const map<DynTypedNode, Metavariable> &metas,
+                         vector<AnchorStep> *path, bool hashed);
+    
+    /// Check if a template node can be an anchor, apart from its position, see MatchAnchor.
+    bool canBeAnchor(const ASTNode &node, const ASTNode *parent) const;
+    
+    /// Emit an instruction instantiating the given metavariable
+    void emitMetavariable(MatchOpcode opcode, const Metavariable &meta);
+    
+    /// A SPAN_META instruction whose metavariable may be instantiated differently when backtracking
+    struct ChoicePoint {
+        size_t pc; ///< The SPAN_META instruction
+        MetavariableSplits splits; ///< The instantiations of the metavariable, resumed at the one being tried
+    };
+    
+    /// Execute the program from the given instruction on a potential match.
+    /// The instantiations of SPAN_META instructions are pushed on the given stack, to be extended when backtracking.
+    /// \return Whether or not the program reached MATCH.
+    bool execute(size_t pc, PotentialMatch &pot, vector<ChoicePoint> &choices) const;
+    
+    /// Backtrack to the most recent choice point with an instantiation left, and continue with that instantiation.
+    /// \param pc Set to the instruction to resume at.
+    /// \return Whether or not there was such a choice point.
+    bool backtrack(PotentialMatch &pot, vector<ChoicePoint> &choices, size_t &pc) const;
+
+public:
+    /// Create an empty program, which does not match anything.
+    LHSMatchProgram() {}
+    
+    /// Compile a template.
+    /// \param subtrees The template subtrees, in order.
+    /// \param metas The metavariables parameterizing the template subtrees.
+    LHSMatchProgram(const vector<DynTypedNode> &subtrees, const map<DynTypedNode, Metavariable> &metas);
+    
+    /// Run the program on a potential match, depth-first, stopping at the first mismatch.
+    /// A fully parameterized metavariable first instantiates a single sibling. When the rest of the program fails,
+    /// the potential match backtracks to the most recent metavariable and extends it by one sibling, like a
+    /// backtracking regular expression matcher. No alternative potential matches are created up front.
+    /// \param candidate The potential match. Holds the successful match, with its metavariables bound, if any.
+    /// \return Whether or not the candidate matches the template.
+    bool run(PotentialMatch &candidate) const;
+    
+    /// Retrieve the template nodes candidates can be looked up by, the first template subtree being the first one.
+    const vector<MatchAnchor> &getAnchors() const { return anchors; }
+    
+    /// Dump the program. Used for debugging purposes
+    void dump(llvm::raw_ostream &out) const;
+};
+    
+} // namespace X
+
+#endif /* LHSMatchProgram_hpp */
@@ -6,6 +6,10 @@
 //  Copyright © 2017 Ruben Opdebeeck. All rights reserved.
 //
 
+#include <cstring>
+
+#include <clang/Basic/CharInfo.h>
+
 #include "LHSTemplate.hpp"
 
 void LHSTemplate::addTemplateSubtree(DynTypedNode subtree) {
@@ -64,230 +68,102 @@ Metavariable LHSTemplate::getMetavariable(DynTypedNode subtree) {
     return it->second;
 }
 
-/// \class PotentialMatchFinder
-/// \brief Helper class whose goal is to find the first potential matches.
-/// Using a recursive AST visitor, it will visit each and every Decl and Stmt
-/// and find AST nodes whose class (type) match the first AST node in our template.
-/// It then creates a potential match whose root contains all siblings following the
-/// found node. As our template can potentially span multiple AST subtrees, all
-/// of the following siblings must be added in order to allow a full match.
-/// Since one of the template subtrees may be a metaparameter, it is vital that
-/// all of the siblings are added, as a metaparameter can potentially match tens of
-/// subtrees.
-class PotentialMatchFinder : public RecursiveASTVisitor<PotentialMatchFinder> {
-    DynTypedNode lhsRoot;
-    shared_ptr<ASTUnit> astUnit;
-    ASTContext &ctx;
-    SourceManager &sm;
-    vector<PotentialMatch> &potentialMatches;
-    
-    public:
-    PotentialMatchFinder(DynTypedNode root, shared_ptr<ASTUnit> ast, vector<PotentialMatch> &potentials)
-        : lhsRoot(root), astUnit(ast), ctx(ast->getASTContext()), sm(ast->getSourceManager()), potentialMatches(potentials) {}
-    
-    bool VisitStmt(Stmt *S) {
-        // Ignore header Stmts
-        if (!sm.isWrittenInMainFile(S->getLocStart())) return true;
+void LHSTemplate::compile() {
+    _program = LHSMatchProgram(_templateSubtrees, _metavariables);
+}
+
+/// Find the start of the potential match an indexed node is the anchor of, by walking up from the node along the path of the anchor.
+/// \return Whether or not the ancestors of the node are positioned as the path of the anchor requires.
+static bool findCandidateStart(ASTIndex &index, const SourceManager &sm, const MatchAnchor &anchor, const IndexedNode &indexed,
+                               DynTypedNode &parent, unsigned &firstChild) {
+    const IndexedNode *entry(&indexed);
+    for (size_t level = anchor.path.size() - 1;; level--) {
+        parent = entry->parent;
+        unsigned siblingIndex(index.getSiblingIndex(parent, entry->node));
+        if (siblingIndex == IndexedNode::NotAChild) return false;
+        const AnchorStep &step(anchor.path[level]);
         
-        if (lhsRoot.getNodeKind().isSame(ASTNodeKind::getFromNode(*S))) {
-            // Potential match found
-            // Find parent, create ASTNode with parent and child, create PotentialMatch
-            DynTypedNode child(DynTypedNode::create(*S));
-            auto parent(ctx.getParents(child)[0]);
-            vector<ASTNode> potentials(ASTNode::fromParentAndChild(parent, child));
-            for (auto &pot : potentials) {
-                potentialMatches.push_back({ pot, astUnit });
-            }
+        // The ancestor at the level of the template subtrees is preceded by the subtrees before the anchor's one
+        if (level == 0) {
+            if (siblingIndex < step.offset) return false;
+            firstChild = siblingIndex - step.offset;
+            
+            // Like the start of any match, the first root must be written in the main file rather than
+            // expanded from a macro or included from a header
+            ASTNode start(ASTNode(parent, &index.getNodeCache()).getChildren()[firstChild]);
+            return !start.isVirtual() && sm.isWrittenInMainFile(start.getNode().getSourceRange().getBegin());
         }
         
-        return true;
-    }
-    
-    bool VisitDecl(Decl *D) {
-        // Ignore header Decls
-        if (!sm.isWrittenInMainFile(D->getLocStart())) return true;
-        
-        if (lhsRoot.getNodeKind().isSame(ASTNodeKind::getFromNode(*D))) {
-            // Potential match found
-            // Find parent, create ASTNode with parent and child, create PotentialMatch
-            DynTypedNode child(DynTypedNode::create(*D));
-            auto parent(ctx.getParents(child)[0]);
-            vector<ASTNode> potentials(ASTNode::fromParentAndChild(parent, child));
-            for (auto &pot : potentials) {
-                potentialMatches.push_back({ pot, astUnit });
-            }
+        if (step.fromEnd) {
+            size_t siblingCount(ASTNode(parent, &index.getNodeCache()).getChildren().size());
+            if (siblingIndex + 1 + step.offset != siblingCount) return false;
+        } else if (siblingIndex != step.offset) {
+            return false;
         }
-        
-        return true;
-    }
-};
-
-// Static lambda's to check certain conditions in an AST traversal
-static auto backtrackedFromChild = [](ASTTraversalState &trv) { return trv.childrenAccessed(); };
-static auto lastChild = [](ASTTraversalState &trv) { return trv.isLastChild(); };
-static auto notLastChild = [](ASTTraversalState &trv) { return !trv.isLastChild(); };
-static auto backtrackToParent = [](ASTTraversalState &trv) { trv.backtrackToParent(); };
-static auto proceedToSibling = [](ASTTraversalState &trv) { trv.nextSibling(); };
-static auto hasChildren = [](ASTTraversalState &trv) { return trv.hasChildren(); };
-static auto descendToChildren = [](ASTTraversalState &trv) { trv.descendToChild(); };
-static auto childlessLastNode = [](ASTTraversalState &trv) { return trv.isLastChild() && !trv.hasChildren(); };
-static auto childlessWithSibling = [](ASTTraversalState &trv) { return !trv.isLastChild() && !trv.hasChildren(); };
-
-// Simple function to remove elements from the potential matches vector if they don't pass a predicate.
-// When predicate returns true for an element, it is kept. Otherwise, it is removed.
-static void filter(vector<PotentialMatch> &potentialMatches, function<bool(ASTTraversalState &)> predicate) {
-    potentialMatches.erase(remove_if(potentialMatches.begin(), potentialMatches.end(), not1(predicate)),
-                           potentialMatches.end());
-}
-
-// Simple function to perform an action on all elements of the potential matches vector
-static void foreach(vector<PotentialMatch> &potentialMatches, function<void(PotentialMatch &)> action) {
-    for (PotentialMatch &pot : potentialMatches) {
-        action(pot);
+        entry = index.getParentEntry(*entry);
+        if (!entry) return false;
     }
 }
 
 vector<ASTResult> LHSTemplate::matchAST(vector<shared_ptr<ASTUnit>> asts) {
-    // First gather all potential matches via a RecursiveASTVisitor
-    vector<PotentialMatch> potentialMatches;
-    for (auto ast : asts) {
-        PotentialMatchFinder pmf(_templateSubtrees[0], ast, potentialMatches);
-        pmf.TraverseDecl(ast->getASTContext().getTranslationUnitDecl());
-    }
-    
-    // Then start the actual matching on the ASTs.
-    vector<ASTNode> lhsSubtrees;
-    for (auto &subtree : _templateSubtrees) {
-        lhsSubtrees.push_back(ASTNode(subtree));
-    }
-    ASTNode lhsRoot(lhsSubtrees);
-    ASTTraversalState templateTraversal(lhsRoot);
-    
-    while (!templateTraversal.astProcessed()) {
-        DynTypedNode &curr(templateTraversal.getCurrent());
+    vector<ASTResult> resultsForFiles;
+    for (auto &ast : asts) {
+        SourceManager &sm(ast->getSourceManager());
+        vector<unique_ptr<pair<MatchResult, TemplateRange>>> resultRanges;
         
-        // There are two cases: either we have backtracked from a child, in which case
-        // the children will be processed, or we came from a sibling or descended from a parent.
-        // In the former case, we need to either proceed to our next sibling, or backtrack to the
-        // parent if we're the last child. No comparison should be done, as that is already done in
-        // the previous step. In the latter case, we need to compare nodes, descend into children if
-        // there are any, or proceed to the next sibling if we have no children.
+        // Potential matches are found through an anchor: a template node at a fixed position in the template.
+        // The anchor with the fewest nodes of its kind and value in this AST is picked, e.g. a boolean literal
+        // rather than the binary operator containing it. Walking up from each of those nodes along the anchor's
+        // path yields the start of a potential match, which is then matched against the entire template.
+        // A potential match spans the start and its following siblings. As our template can potentially span
+        // multiple AST subtrees, all of the following siblings must be available in order to allow a full match.
+        // Since one of the template subtrees may be a metaparameter, it is vital that all of the siblings are
+        // available, as a metaparameter can potentially match tens of subtrees. The span is open-ended: its end
+        // is determined while matching, by the number of siblings the template needs.
+        auto index(ASTIndex::forAST(ast));
         
-        // If we have backtracked from a child, either continue to the next sibling or backtrack to
-        // our parent, if we're the last child. Verify and adjust the traversal in the potential matches
-        // in either case.
-        if (backtrackedFromChild(templateTraversal)) {
-            if (lastChild(templateTraversal)) {
-                // Remove any potential match that is not at the last child
-                filter(potentialMatches, lastChild);
-                foreach(potentialMatches, backtrackToParent);
-                templateTraversal.backtrackToParent();
-            } else {
-                // Proceed to sibling, keep only potential matches that are not the last child
-                filter(potentialMatches, notLastChild);
-                foreach(potentialMatches, proceedToSibling);
-                templateTraversal.nextSibling();
+        // Without anchors, e.g. when the template starts with a metaparameter, fall back to the kind of the first subtree.
+        // Every node matching an anchor is in the index, so an anchor without nodes means the template can't match.
+        MatchAnchor fallback;
+        fallback.kind = _templateSubtrees[0].getNodeKind();
+        fallback.path.push_back({ 0, false });
+        
+        const MatchAnchor *anchor(&fallback);
+        size_t anchorCount(index->countNodesOfKind(fallback.kind));
+        for (auto it = _program.getAnchors().begin(); it != _program.getAnchors().end(); it++) {
+            size_t count(it->hasValue ? index->getNodesWithValue(it->kind, it->value).size() : index->countNodesOfKind(it->kind));
+            if (it == _program.getAnchors().begin() || count < anchorCount) {
+                anchor = &*it;
+                anchorCount = count;
             }
         }
         
-        // When we come from a parent or a previous sibling, first we need to compare the node itself.
-        // Afterwards, when there are children, descend into them, otherwise, go to the next sibling.
-        // An exception to this rule is when the current node is a metaparameter, then we don't need to
-        // compare anything and just instantiate the metaparameter
-        else {
-            if (isMetavariable(curr)) {
-                Metavariable meta(getMetavariable(curr));
-                
-                // For metavariables which only parameterize the name, we still need to match everything else
-                if (meta.nameOnly) {
-                    // Match the nodes, except their names
-                    filter(potentialMatches, [&curr](auto &pot) { return compare(curr, pot.getCurrent(), true); });
-                    // For each remaining potential match, take the current node as the instantiation of the metavariable
-                    // Name-only metavariables can only span one node, one NamedDecl, so there is no need for extending
-                    foreach(potentialMatches, [&meta](auto &pot) { pot.instantiateCurrentAsMetavariable(meta); });
-                    
-                    // We still need to match the children of this node, to make sure the name-only metavar also matches these
-                    // This is done further down
-                } else {
-                    // A fully parameterized template metavariable may instantiate multiple AST nodes, hence our potential match
-                    // list should be extended with copies of the existing potential matches, each instantiating a part of our
-                    // siblings as the metavariable. Inconsistent instantiations will be removed later on. There is no need to
-                    // traverse our children.
-                    vector<PotentialMatch> extendedList;
-                    foreach(potentialMatches, [&meta, &extendedList](auto &pot) { pot.extendForMetavariable(meta, extendedList); });
-                    potentialMatches = extendedList;
-                    
-                    // Traverse to the next sibling if there is any, otherwise go back to the parent. Remove inconsistencies
-                    // We don't care about children as we've just instantiated a fully parameterized metavariable.
-                    if (templateTraversal.isLastChild()) {
-                        filter(potentialMatches, lastChild);
-                        foreach(potentialMatches, backtrackToParent);
-                        templateTraversal.backtrackToParent();
-                    } else {
-                        filter(potentialMatches, notLastChild);
-                        foreach(potentialMatches, proceedToSibling);
-                        
-                        // A metavariable can span multiple nodes in the AST, so proceed to the next sibling that is not part
-                        // of this metavariable
-                        templateTraversal.nextSibling();
-                        for (DynTypedNode *next = &templateTraversal.getCurrent();
-                             isMetavariable(*next) && getMetavariable(*next).identifier == meta.identifier;
-                             next = &templateTraversal.nextSibling()) {
-                            if (templateTraversal.isLastChild()) {
-                                filter(potentialMatches, lastChild);
-                                foreach(potentialMatches, backtrackToParent);
-                                templateTraversal.backtrackToParent();
-                                break;
-                            }
-                        }
-                    }
-                    
-                    continue; // No need to do the rest of the checks anymore
-                }
-            } else {
-                // For nodes that are not parameterized, we need to compare the AST nodes and remove inconsistenties.
-                filter(potentialMatches, [&curr](auto &pot) { return compare(curr, pot.getCurrent()); });
-            }
-            
-            // If there are children, descend to them if we need to
-            // Remove potential matches without children
-            if (templateTraversal.hasChildren()) {
-                filter(potentialMatches, hasChildren);
-                foreach(potentialMatches, descendToChildren);
-                templateTraversal.descendToChild();
-            }
-            
-            // Otherwise, proceed to the next sibling if there is one.
-            else if (templateTraversal.isLastChild()) {
-                filter(potentialMatches, childlessLastNode);
-                foreach(potentialMatches, backtrackToParent);
-                templateTraversal.backtrackToParent();
-            } else {
-                filter(potentialMatches, childlessWithSibling);
-                foreach(potentialMatches, proceedToSibling);
-                templateTraversal.nextSibling();
+        vector<const IndexedNode *> anchorNodes;
+        if (anchor->hasValue) {
+            anchorNodes = index->getNodesWithValue(anchor->kind, anchor->value);
+        } else {
+            for (const IndexedNode &indexed : index->getNodesOfKind(anchor->kind)) {
+                anchorNodes.push_back(&indexed);
             }
         }
-    }
-    
-    // Partition the match results into separate lists for each file given to us
-    vector<ASTResult> resultsForFiles;
-    for (auto &ast : asts) {
-        SourceManager &sm(ast->getSourceManager());
-        vector<unique_ptr<pair<MatchResult, TemplateRange>>> resultRanges;
         
-        // Gather all match results, together with their ranges, for this AST
-        foreach(potentialMatches, [&](auto &pot) {
+        for (const IndexedNode *indexed : anchorNodes) {
+            DynTypedNode parent;
+            unsigned firstChild;
+            if (!findCandidateStart(*index, sm, *anchor, *indexed, parent, firstChild)) continue;
+            
+            // Match each potential match on its own, only the successful ones are kept, together with their ranges
+            PotentialMatch pot(ASTNode(parent, &index->getNodeCache()), firstChild, ast);
+            if (!_program.run(pot)) continue;
+            
             auto roots = pot.getMatchRoot();
             SourceLocation begin(roots[0].getSourceRange().getBegin());
             SourceLocation end(roots[roots.size()-1].getSourceRange().getEnd());
-            if (ast == pot.getOwner()) {
-                TemplateRange tr(TemplateLocation::fromSourceLocation(begin, sm),
-                                 TemplateLocation::fromSourceLocation(end, sm));
-                MatchResult mr(roots, pot.getMetavariables());
-                resultRanges.push_back(llvm::make_unique<pair<MatchResult, TemplateRange>>(mr, tr));
-            }
-        });
+            TemplateRange tr(TemplateLocation::fromSourceLocation(begin, sm),
+                             TemplateLocation::fromSourceLocation(end, sm));
+            MatchResult mr(roots, pot.getMetavariables());
+            resultRanges.push_back(llvm::make_unique<pair<MatchResult, TemplateRange>>(mr, tr));
+        }
         
         if (resultRanges.empty()) continue;
         
@@ -306,12 +182,84 @@ vector<ASTResult> LHSTemplate::matchAST(vector<shared_ptr<ASTUnit>> asts) {
             }
         }
         
-        resultsForFiles.push_back(ASTResult(ast, results));
+        resultsForFiles.push_back(ASTResult(ast, results, index));
     }
     
     return resultsForFiles;
 }
 
+/// Check if a token is spelled out at a location of the template source.
+/// Implicit code and macro expansions have locations where something else, or nothing at all, is written.
+static bool isSpelledAt(SourceLocation loc, StringRef token, const SourceManager &sm) {
+    if (loc.isInvalid() || !loc.isFileID()) return false;
+    
+    bool invalid = false;
+    const char *data = sm.getCharacterData(loc, &invalid);
+    if (invalid || strncmp(data, token.data(), token.size()) != 0) return false;
+    
+    // The token must not merely be the prefix of a longer identifier
+    return !isIdentifierBody(data[token.size()]);
+}
+
+/// Add a token, if it is spelled out at the given location of the template source.
+static void addToken(StringRef token, SourceLocation loc, const SourceManager &sm, set<string> &tokens) {
+    if (isSpelledAt(loc, token, sm)) {
+        tokens.insert(token);
+    }
+}
+
+/// Add the identifier naming a declaration, if the declaration is spelled out at the given location.
+static void addIdentifier(const NamedDecl *decl, SourceLocation loc, const SourceManager &sm, set<string> &tokens) {
+    if (!decl || decl->isImplicit()) return;
+    
+    // Operators, constructors and the like are not spelled as a single identifier
+    if (IdentifierInfo *identifier = decl->getDeclName().getAsIdentifierInfo()) {
+        addToken(identifier->getName(), loc, sm, tokens);
+    }
+}
+
+void LHSTemplate::collectRequiredTokens(const ASTNode &node, const SourceManager &sm, set<string> &tokens) {
+    if (!node.isVirtual()) {
+        const DynTypedNode &curr(node.getNode());
+        bool nameOnly = false;
+        
+        // Fully parameterized subtrees can match anything, name-only metavariables still constrain their children
+        if (isMetavariable(curr)) {
+            if (!getMetavariable(curr).nameOnly) return;
+            nameOnly = true;
+        }
+        
+        // Only add tokens for properties which are compared by the matching algorithm
+        if (nameOnly) {
+            // The name of the node itself is parameterized
+        } else if (const DeclRefExpr *ref = curr.get<DeclRefExpr>()) {
+            addIdentifier(ref->getDecl(), ref->getLocation(), sm, tokens);
+        } else if (const MemberExpr *member = curr.get<MemberExpr>()) {
+            addIdentifier(member->getMemberDecl(), member->getMemberLoc(), sm, tokens);
+        } else if (const CXXBoolLiteralExpr *literal = curr.get<CXXBoolLiteralExpr>()) {
+            addToken(literal->getValue() ? "true" : "false", literal->getLocation(), sm, tokens);
+        } else if (const UsingDirectiveDecl *directive = curr.get<UsingDirectiveDecl>()) {
+            addIdentifier(directive->getNominatedNamespaceAsWritten(), directive->getIdentLocation(), sm, tokens);
+        } else if (const NamedDecl *decl = curr.get<NamedDecl>()) {
+            addIdentifier(decl, decl->getLocation(), sm, tokens);
+        }
+    }
+    
+    for (const ASTNode &child : node.getChildren()) {
+        collectRequiredTokens(child, sm, tokens);
+    }
+}
+
+set<string> LHSTemplate::getRequiredTokens(const SourceManager &sm) {
+    set<string> tokens;
+    for (auto &subtree : _templateSubtrees) {
+        ASTNode node(subtree);
+        collectRequiredTokens(node, sm, tokens);
+    }
+    
+    return tokens;
+}
+
 void LHSTemplate::dump(SourceManager &sm) {
     llvm::outs() << "Template subtrees:\n~~~~~~~~~~~~~~~~~~\n\n";
     for (auto &subtree : _templateSubtrees) {
@@ -330,4 +278,6 @@ void LHSTemplate::dump(SourceManager &sm) {
         llvm::outs() << "\n\n";
     }
     
+    llvm::outs() << "Match program:\n~~~~~~~~~~~~~~\n\n";
+    _program.dump(llvm::outs());
 }
@@ -13,6 +13,8 @@
 
 #include "LHSTemplateParser.hpp"
 #include "ASTTraversalState.hpp"
+#include "ASTIndex.hpp"
+#include "LHSMatchProgram.hpp"
 #include "LHSComparators.hpp"
 
 using namespace std;
@@ -34,7 +36,9 @@ struct MatchResult {
 struct ASTResult {
     shared_ptr<ASTUnit> ast;
     vector<MatchResult> matches;
-    ASTResult(shared_ptr<ASTUnit> astUnit, vector<MatchResult> res) : ast(astUnit), matches(res) {}
+    shared_ptr<ASTIndex> index; ///< The index of the AST, owning the child lists referenced by the metavariable instantiations
+    ASTResult(shared_ptr<ASTUnit> astUnit, vector<MatchResult> res, shared_ptr<ASTIndex> astIndex)
+        : ast(astUnit), matches(res), index(astIndex) {}
 };
 
 /// \class LHSTemplate
@@ -51,6 +55,13 @@ class LHSTemplate {
     /// this is fine because the template doesn't need to know what is underneath the metavariable.
     map<DynTypedNode, Metavariable> _metavariables;
     
+    /// Add the tokens required by a template node and its children, except those parameterized by metavariables
+    /// and those which are not spelled out in the template source, such as implicit code and macro expansions.
+    void collectRequiredTokens(const ASTNode &node, const SourceManager &sm, set<string> &tokens);
+    
+    /// The template compiled to a match program, see compile()
+    LHSMatchProgram _program;
+
 public:
     LHSTemplate() {}
     
@@ -68,6 +79,10 @@ public:
     /// Retrieve the metavariable representing this subtree
     Metavariable getMetavariable(DynTypedNode subtree);
     
+    /// Compile the template subtrees and metavariables to the program used by matchAST.
+    /// Must be called once the template is complete, i.e. after all subtrees and metavariables have been added.
+    void compile();
+    
     /// Match the LHS template on a list of ASTs
     /// It returns a list of match results. The results are ordered
     /// based on the source ranges of the matches, with matches that
@@ -80,10 +95,19 @@ public:
     /// when overlapping regions are rewritten.
     vector<ASTResult> matchAST(vector<shared_ptr<ASTUnit>> asts);
     
+    /// Retrieve the identifiers and keywords every match of this template must spell out in its source code.
+    /// These are the names of declarations and referenced declarations, and boolean literals, which are not part
+    /// of a metavariable. A source file that does not contain all of them cannot contain a match, unless the match
+    /// is formed by expanding macros defined outside of the source file.
+    /// Names which are not spelled out in the template itself, such as the begin and end calls of a range-based
+    /// for loop or the functions called by an assert macro, are not required.
+    /// \param sm The source manager of the template source file
+    set<string> getRequiredTokens(const SourceManager &sm);
+    
     /// Dump the template. Used for debugging purposes
     void dump(SourceManager &sm);
 };
-
+    
 } // namespace X
 
 #endif /* LHSTemplate_hpp */
@@ -295,6 +295,9 @@ bool LHSParserVisitor::TraverseDecl(Decl *D) {
     
     if (!D) return true; // Empty node, continue search
     
+    // Don't descend into declarations from included files, the template is written in the main file
+    if (isFileLevelDeclOutsideMainFile(D, _sm)) return true;
+    
     // If we just started a translation unit, don't try to parse anything as a declaration unit doesn't have
     // a valid source location. Just start the traversal
     if (D->getKind() == Decl::TranslationUnit) return RecursiveASTVisitor<LHSParserVisitor>::TraverseDecl(D);
@@ -91,6 +91,16 @@ private:
 using SubtreeList = vector<StmtOrDecl>;
 using SubtreeQueue = queue<StmtOrDecl>;
     
+/// Check if a top-level or namespace-level declaration lies entirely outside the main file, e.g. because it was
+/// included from a header. Nothing in its subtree is written in the main file, so it does not need to be traversed.
+/// Returns false for any other declaration, those are pruned along with their top-level declaration.
+inline bool isFileLevelDeclOutsideMainFile(const Decl *D, const SourceManager &sm) {
+    if (llvm::isa<TranslationUnitDecl>(D) || !D->getDeclContext()->getRedeclContext()->isFileContext()) return false;
+    
+    SourceRange range(D->getSourceRange());
+    return !sm.isInMainFile(range.getBegin()) && !sm.isInMainFile(range.getEnd());
+}
+    
 
 /// \class LHSParserVisitor
 /// \brief An LHS template parser implementing the RecursiveASTVisitor class in order to visit all AST nodes of the template source
@@ -218,6 +228,7 @@ public:
         }
         
         _tmpl = visitor.retrieveLHSTemplate();
+        _tmpl->compile();
     }
     
     /// Retrieve the constructed LHS template
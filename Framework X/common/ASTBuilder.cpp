@@ -0,0 +1,419 @@
+//
+//  ASTBuilder.cpp
+//  Framework X
+//
+//  Created by Ruben Opdebeeck on 12/06/2017.
+//  Copyright © 2017 Ruben Opdebeeck. All rights reserved.
+//
+
+#include "ASTBuilder.hpp"
+
+#include <clang/Frontend/PCHContainerOperations.h>
+
+using namespace X;
+
+ASTBuilder::ASTBuilder(const CompilationDatabase &compilations, const ParseOptions &options)
+    : _compilations(compilations), _jobs(options.jobs), _window(max(options.jobs, 1u)) {
+    
+    if (!options.prefixHeader.empty()) {
+        _prefixHeader = getAbsolutePath(options.prefixHeader);
+    }
+    
+    if (!options.cacheDirectory.empty()) {
+        _cacheDirectory = getAbsolutePath(options.cacheDirectory);
+        if (llvm::sys::fs::create_directories(_cacheDirectory)) {
+            llvm::errs() << "Unable to create AST cache directory " << _cacheDirectory << ", parsing without cache\n";
+            _cacheDirectory.clear();
+        }
+    }
+}
+
+void ASTBuilder::parse(const SourceList &sourceFiles) {
+    assert(!_started && "The builder has already been given a list of source files");
+    _started = true;
+    
+    _sourceFiles = sourceFiles;
+    _ASTs.resize(sourceFiles.size());
+    _dependencies.resize(sourceFiles.size());
+    _parsed.assign(sourceFiles.size(), false);
+    
+    // With a single job, ASTs are simply parsed on demand by the consumer
+    if (_jobs <= 1) return;
+    
+    // Clang changes the process-wide working directory to the one of the compile command and back, which is only
+    // safe on worker threads when that is the current working directory already
+    if (!runsInWorkingDirectory(sourceFiles)) {
+        llvm::errs() << "Not all compile commands run in the current working directory, parsing serially\n";
+        return;
+    }
+    
+    for (unsigned i = 0; i < _jobs && i < sourceFiles.size(); i++) {
+        _workers.push_back(thread(&ASTBuilder::work, this));
+    }
+}
+
+ASTBuilder::~ASTBuilder() {
+    {
+        lock_guard<mutex> lock(_mutex);
+        _stopping = true;
+    }
+    _consumedCondition.notify_all();
+    
+    // Workers that are still parsing a file will finish it before stopping
+    for (thread &worker : _workers) {
+        worker.join();
+    }
+    
+    removePrecompiledHeaders();
+}
+
+void ASTBuilder::removePrecompiledHeaders() {
+    // Unless they are cached, the PCHs only live as long as the builder
+    if (!_cacheDirectory.empty()) return;
+    
+    lock_guard<mutex> lock(_PCHMutex);
+    for (auto &pch : _PCHs) {
+        if (!pch.second.path.empty() && pch.second.owner == getpid()) {
+            llvm::sys::fs::remove(pch.second.path);
+            pch.second.path.clear();
+        }
+    }
+}
+
+void ASTBuilder::work() {
+    unique_lock<mutex> lock(_mutex);
+    
+    while (true) {
+        // Don't run too far ahead of the consumer, otherwise we'd keep too many ASTs alive
+        _consumedCondition.wait(lock, [this] {
+            return _stopping || _nextToParse >= _sourceFiles.size() || _nextToParse < _nextToConsume + _window;
+        });
+        
+        if (_stopping || _nextToParse >= _sourceFiles.size()) return;
+        
+        unsigned idx = _nextToParse++;
+        
+        // Parse without holding the lock, so other workers can parse at the same time
+        lock.unlock();
+        DependencyList dependencies;
+        unique_ptr<ASTUnit> ast(buildAST(_sourceFiles[idx], dependencies));
+        lock.lock();
+        
+        _ASTs[idx] = move(ast);
+        _dependencies[idx] = move(dependencies);
+        _parsed[idx] = true;
+        _parsedCondition.notify_all();
+    }
+}
+
+bool ASTBuilder::runsInWorkingDirectory(const SourceList &sourceFiles) const {
+    llvm::SmallString<128> cwd;
+    if (llvm::sys::fs::current_path(cwd)) return false;
+    
+    // Most source files share the same few directories, so each of them is only compared once
+    set<string> checked;
+    for (const string &sourceFile : sourceFiles) {
+        if (isASTFile(sourceFile)) continue;
+        
+        for (const CompileCommand &command : _compilations.getCompileCommands(getAbsolutePath(sourceFile))) {
+            if (!checked.insert(command.Directory).second) continue;
+            
+            // Compare the files themselves, the directory may be relative or reached through a symbolic link
+            bool same = false;
+            if (llvm::sys::fs::equivalent(command.Directory, cwd, same) || !same) return false;
+        }
+    }
+    
+    return true;
+}
+
+bool ASTBuilder::next(string &sourceFile, unique_ptr<ASTUnit> &ast, DependencyList &dependencies) {
+    if (_nextToConsume >= _sourceFiles.size()) return false;
+    
+    unsigned idx = _nextToConsume;
+    sourceFile = _sourceFiles[idx];
+    
+    if (_workers.empty()) {
+        dependencies.clear();
+        ast = buildAST(sourceFile, dependencies);
+        _nextToConsume++;
+        return true;
+    }
+    
+    // Wait until a worker has parsed this source file. Hand out the ASTs in the order of the source list,
+    // so the results are identical to those of a serial run.
+    {
+        unique_lock<mutex> lock(_mutex);
+        _parsedCondition.wait(lock, [this, idx] { return _parsed[idx]; });
+        ast = move(_ASTs[idx]);
+        dependencies = move(_dependencies[idx]);
+        _nextToConsume++;
+    }
+    _consumedCondition.notify_all();
+    
+    return true;
+}
+
+/// Check if a command line argument is the source file the compile command compiles.
+static bool isSourceArgument(const string &arg, const CompileCommand &command) {
+    if (arg.empty() || arg[0] == '-') return false;
+    return arg == command.Filename || llvm::sys::path::filename(arg) == llvm::sys::path::filename(command.Filename);
+}
+
+/// Strip the source file and the output from a compile command, leaving only the compiler and its flags.
+static CommandLineArguments getCompileFlags(const CompileCommand &command) {
+    CommandLineArguments flags;
+    for (const string &arg : getClangStripOutputAdjuster()(command.CommandLine, command.Filename)) {
+        if (!isSourceArgument(arg, command)) flags.push_back(arg);
+    }
+    return flags;
+}
+
+/// Identifies the compiler invocation of a compile command, regardless of the source file it compiles.
+static string getFlagsKey(const CompileCommand &command) {
+    string key(command.Directory);
+    for (const string &flag : getCompileFlags(command)) {
+        key += '\0';
+        key += flag;
+    }
+    return key;
+}
+
+/// Generates a PCH, while collecting the files it has been built from.
+class DependencyCollectingPCHAction : public GeneratePCHAction {
+    DependencyList &_dependencies;
+
+public:
+    DependencyCollectingPCHAction(DependencyList &dependencies) : _dependencies(dependencies) {}
+    
+    void EndSourceFileAction() override {
+        _dependencies = collectDependencies(getCompilerInstance().getSourceManager());
+        GeneratePCHAction::EndSourceFileAction();
+    }
+};
+
+class DependencyCollectingPCHActionFactory : public FrontendActionFactory {
+    DependencyList &_dependencies;
+
+public:
+    DependencyCollectingPCHActionFactory(DependencyList &dependencies) : _dependencies(dependencies) {}
+    
+    FrontendAction *create() override {
+        return new DependencyCollectingPCHAction(_dependencies);
+    }
+};
+
+const ASTBuilder::PrecompiledHeader &ASTBuilder::getPrecompiledHeader(const CompileCommand &command) {
+    // Source files compiled with the same flags in the same directory can share a PCH
+    string key(getFlagsKey(command));
+    
+    // Hold the lock while building, so no two workers build the same PCH
+    lock_guard<mutex> lock(_PCHMutex);
+    auto it = _PCHs.find(key);
+    if (it != _PCHs.end()) return it->second;
+    
+    PrecompiledHeader &pch(_PCHs[key]);
+    DependencyList &dependencies(pch.dependencies);
+    
+    if (!_cacheDirectory.empty()) {
+        // Reuse the PCH of a previous run, as long as the prefix header and the headers it includes did not change
+        string cachedPath(getCachePath(hashString(key + '\0' + _prefixHeader), "pch"));
+        if (readDependencies(cachedPath + ".deps", dependencies) && dependenciesUnchanged(dependencies)
+            && llvm::sys::fs::exists(cachedPath)) {
+            pch.path = cachedPath;
+            return pch;
+        }
+        
+        // Remove the dependencies first, so an interrupted build never leaves a PCH that appears to be valid
+        dependencies.clear();
+        llvm::sys::fs::remove(cachedPath + ".deps");
+        if (buildPrecompiledHeader(command, cachedPath, dependencies)) {
+            writeDependencies(cachedPath + ".deps", dependencies);
+            pch.path = cachedPath;
+        }
+        return pch;
+    }
+    
+    llvm::SmallString<128> tempPath;
+    if (llvm::sys::fs::createTemporaryFile("framework-x-prefix", "pch", tempPath)) {
+        llvm::errs() << "Unable to create a temporary file for the precompiled prefix header\n";
+        return pch;
+    }
+    
+    if (!buildPrecompiledHeader(command, tempPath.str(), dependencies)) {
+        llvm::sys::fs::remove(tempPath);
+        return pch;
+    }
+    
+    pch.path = tempPath.str();
+    pch.owner = getpid();
+    return pch;
+}
+
+bool ASTBuilder::buildPrecompiledHeader(const CompileCommand &command, const string &pchPath, DependencyList &dependencies) {
+    // Precompile the prefix header using the flags of the source file.
+    // The compiler in the first argument is supplied by the fixed compilation database, so drop it.
+    CommandLineArguments flags(getCompileFlags(command));
+    CommandLineArguments pchFlags(flags.begin() + 1, flags.end());
+    pchFlags.push_back("-x");
+    pchFlags.push_back("c++-header");
+    FixedCompilationDatabase pchCompilations(command.Directory, pchFlags);
+    ClangTool PCHTool(pchCompilations, { _prefixHeader });
+    PCHTool.clearArgumentsAdjusters();
+    PCHTool.appendArgumentsAdjuster(getInsertArgumentAdjuster({ "-o", pchPath }, ArgumentInsertPosition::END));
+    
+    DependencyCollectingPCHActionFactory factory(dependencies);
+    if (PCHTool.run(&factory) != 0) {
+        llvm::errs() << "Failed to precompile prefix header " << _prefixHeader << ", parsing without it\n";
+        return false;
+    }
+    
+    return true;
+}
+
+unique_ptr<ASTUnit> ASTBuilder::parseAST(const string &sourceFile, const string &pch) {
+    // Uses a ClangTool to easily parse ASTs, so we do not have to worry about parsing command line options from the
+    // compilation database. Every call creates its own tool, so nothing is shared between worker threads.
+    vector<unique_ptr<ASTUnit>> ASTs;
+    ClangTool ASTParserTool(_compilations, { sourceFile });
+    
+    if (!pch.empty()) {
+        ASTParserTool.appendArgumentsAdjuster(getInsertArgumentAdjuster({ "-include-pch", pch }, ArgumentInsertPosition::END));
+    }
+    
+    ASTParserTool.buildASTs(ASTs);
+    
+    if (ASTs.empty()) return nullptr;
+    return move(ASTs[0]);
+}
+
+string ASTBuilder::getCachePath(const string &key, const string &extension) const {
+    llvm::SmallString<128> path(_cacheDirectory);
+    llvm::sys::path::append(path, key + "." + extension);
+    return path.str();
+}
+
+/// Loaded ASTs keep a reference to the reader they have been loaded with, so it must outlive all of them
+static const RawPCHContainerReader ASTFileReader;
+
+/// Load a serialized AST, as written by ASTUnit::Save or `clang -emit-ast`.
+static unique_ptr<ASTUnit> loadASTFile(const string &path) {
+    IntrusiveRefCntPtr<DiagnosticsEngine> diagnostics(CompilerInstance::createDiagnostics(new DiagnosticOptions()));
+    return ASTUnit::LoadFromASTFile(path, ASTFileReader, diagnostics, FileSystemOptions());
+}
+
+unique_ptr<ASTUnit> ASTBuilder::loadCachedAST(const string &key, DependencyList &dependencies) {
+    string astPath(getCachePath(key, "ast"));
+    if (!readDependencies(astPath + ".deps", dependencies) || !dependenciesUnchanged(dependencies)) return nullptr;
+    
+    return loadASTFile(astPath);
+}
+
+void ASTBuilder::storeCachedAST(const string &key, ASTUnit &ast, const DependencyList &dependencies) {
+    string astPath(getCachePath(key, "ast"));
+    
+    // Remove the dependencies first, so a failed save never leaves an entry that appears to be valid
+    llvm::sys::fs::remove(astPath + ".deps");
+    if (ast.Save(astPath)) {
+        llvm::errs() << "Unable to write " << astPath << " to the AST cache\n";
+        return;
+    }
+    
+    writeDependencies(astPath + ".deps", dependencies);
+}
+
+string ASTBuilder::getCompileCommandKey(const string &sourceFile) const {
+    vector<CompileCommand> commands(_compilations.getCompileCommands(getAbsolutePath(sourceFile)));
+    if (commands.empty()) return "";
+    
+    return hashString(getFlagsKey(commands[0]) + '\0' + _prefixHeader);
+}
+
+unique_ptr<ASTUnit> ASTBuilder::buildAST(const string &sourceFile) {
+    DependencyList dependencies;
+    return buildAST(sourceFile, dependencies);
+}
+
+unique_ptr<ASTUnit> ASTBuilder::buildAST(const string &sourceFile, DependencyList &dependencies) {
+    // ASTs serialized by the build are loaded as they are, they have already been parsed with the right flags.
+    // Their dependencies are unknown.
+    if (isASTFile(sourceFile)) return loadASTFile(sourceFile);
+    
+    string path(getAbsolutePath(sourceFile));
+    vector<CompileCommand> commands(_compilations.getCompileCommands(path));
+    
+    // Include the PCH for the flags of this source file
+    const PrecompiledHeader *pch = nullptr;
+    if (!_prefixHeader.empty() && !commands.empty()) {
+        pch = &getPrecompiledHeader(commands[0]);
+        if (pch->path.empty()) pch = nullptr;
+    }
+    
+    // The same source file compiled with different flags results in a different AST
+    string key;
+    if (!_cacheDirectory.empty() && !commands.empty()) {
+        key = hashString(path + '\0' + getCompileCommandKey(path));
+        
+        if (unique_ptr<ASTUnit> cached = loadCachedAST(key, dependencies)) {
+            // The PCH itself is only a dependency of the cache entry
+            if (pch) {
+                dependencies.erase(remove_if(dependencies.begin(), dependencies.end(),
+                                             [pch](const FileDependency &dep) { return dep.path == pch->path; }),
+                                   dependencies.end());
+            }
+            return cached;
+        }
+    }
+    
+    unique_ptr<ASTUnit> ast(parseAST(sourceFile, pch ? pch->path : ""));
+    if (!ast) {
+        dependencies.clear();
+        return nullptr;
+    }
+    
+    // The files included through the PCH are not read into the source manager of the AST
+    dependencies = collectDependencies(ast->getSourceManager());
+    if (pch) dependencies.insert(dependencies.end(), pch->dependencies.begin(), pch->dependencies.end());
+    
+    if (!key.empty()) {
+        // The cached AST refers to the PCH, so the entry becomes invalid when the PCH is rebuilt
+        DependencyList cacheDependencies(dependencies);
+        if (pch) cacheDependencies.push_back({ pch->path, hashFileContents(pch->path) });
+        storeCachedAST(key, *ast, cacheDependencies);
+    }
+    
+    return ast;
+}
+
+bool X::isASTFile(const string &path) {
+    return llvm::sys::path::extension(path) == ".ast";
+}
+
+SourceList X::expandInputs(const SourceList &inputs) {
+    SourceList expanded;
+    
+    for (const string &input : inputs) {
+        if (!llvm::sys::fs::is_directory(input)) {
+            expanded.push_back(input);
+            continue;
+        }
+        
+        // Sort the AST files of a directory, so the order does not depend on the file system
+        SourceList ASTFiles;
+        error_code ec;
+        for (llvm::sys::fs::recursive_directory_iterator it(input, ec), end; it != end && !ec; it.increment(ec)) {
+            if (isASTFile(it->path()) && !llvm::sys::fs::is_directory(it->path())) {
+                ASTFiles.push_back(it->path());
+            }
+        }
+        
+        if (ec) {
+            llvm::errs() << "Unable to read directory " << input << ": " << ec.message() << "\n";
+        }
+        
+        sort(ASTFiles.begin(), ASTFiles.end());
+        expanded.insert(expanded.end(), ASTFiles.begin(), ASTFiles.end());
+    }
+    
+    return expanded;
+}
@@ -0,0 +1,199 @@
+//
+//  ASTBuilder.hpp
+//  Framework X
+//
+//  Created by Ruben Opdebeeck on 12/06/2017.
+//  Copyright © 2017 Ruben Opdebeeck. All rights reserved.
+//
+
+#ifndef ASTBuilder_hpp
+#define ASTBuilder_hpp
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <map>
+#include <set>
+#include <algorithm>
+
+#include <unistd.h>
+
+#include <clang/Frontend/ASTUnit.h>
+#include <clang/Tooling/Tooling.h>
+#include <clang/Tooling/ArgumentsAdjusters.h>
+#include <clang/Frontend/FrontendActions.h>
+#include <clang/Frontend/CompilerInstance.h>
+#include <llvm/Support/FileSystem.h>
+#include <llvm/Support/Path.h>
+
+#include "FileHash.hpp"
+
+using namespace clang;
+using namespace clang::tooling;
+using namespace std;
+using SourceList = vector<string>;
+
+namespace X {
+
+/// Options controlling how source files are parsed into ASTs.
+struct ParseOptions {
+    unsigned jobs = 1; ///< The number of worker threads used to parse source files.
+    string prefixHeader; ///< A header including the headers shared by all source files, which will be precompiled. Empty to disable.
+    string cacheDirectory; ///< Directory in which parsed ASTs are cached between runs. Empty to disable.
+};
+
+/// Check whether a path refers to a serialized AST, e.g. one produced by `clang -emit-ast`.
+bool isASTFile(const string &path);
+
+/// Replace every directory in a list of inputs with the serialized AST files it contains, recursively.
+/// The AST files of a directory are sorted by path, other inputs are kept as they are.
+SourceList expandInputs(const SourceList &inputs);
+
+/// \class ASTBuilder
+/// \brief Builds the ASTs for a list of source files, one translation unit at a time.
+///
+/// Single source files can be parsed at any time using buildAST(), e.g. to parse a source file whose AST is needed to
+/// decide which source files should be parsed, before handing the list of source files to the builder.
+///
+/// ASTs are handed out in the order of the source list, regardless of the order in which they have been parsed.
+/// When more than one job is requested, a pool of worker threads parses the source files ahead of the consumer.
+/// Every worker parses each of its files using its own ClangTool, and thus its own CompilerInstance and FileManager,
+/// so no Clang state is shared between the threads. Workers never run more than `jobs` files ahead of the consumer,
+/// which bounds the number of ASTs that are alive at the same time.
+///
+/// Clang changes the process-wide working directory to the one of the compile command while parsing a source file, and
+/// back once it is done. This is harmless on a single thread, but workers would change it from under each other and
+/// from under the consumer. The workers are therefore only started when every compile command runs in the current
+/// working directory, so the working directory never actually changes. Otherwise, the source files are parsed serially.
+///
+/// When a prefix header is given, it is precompiled once for each distinct set of compile flags in the compilation
+/// database, and the resulting PCH is included in every translation unit compiled with those flags. The headers in the
+/// prefix header then only need to be parsed once, regardless of the number of source files. Source files may still
+/// include these headers themselves, their include guards make sure they are skipped.
+///
+/// When a cache directory is given, every parsed AST is serialized into it, along with the hashes of the contents of
+/// all files it was built from. The entry of a source file is keyed by its path and its compile command. As long as
+/// none of the files it was built from changed, later runs load the AST from the cache instead of parsing it again.
+/// Precompiled prefix headers are kept in the cache directory as well, as the cached ASTs refer to them.
+///
+/// Source files with the `.ast` extension are serialized ASTs, e.g. produced by `clang -emit-ast`, which are loaded
+/// directly instead of being parsed. They are neither cached nor combined with the prefix header.
+class ASTBuilder {
+    const CompilationDatabase &_compilations;
+    SourceList _sourceFiles;
+    unsigned _jobs; ///< The number of worker threads used to parse the source list
+    string _prefixHeader; ///< Absolute path to the prefix header, empty when no PCH should be used
+    string _cacheDirectory; ///< Absolute path to the AST cache, empty when ASTs should not be cached
+    
+    /// A precompiled prefix header, along with the files it has been built from
+    struct PrecompiledHeader {
+        string path; ///< The path to the PCH, or an empty string if it failed to build
+        pid_t owner = 0; ///< The process that built the temporary PCH, which is responsible for removing it
+        DependencyList dependencies;
+    };
+    
+    map<string, PrecompiledHeader> _PCHs; ///< The PCH built for each distinct set of compile flags
+    mutex _PCHMutex;
+    
+    vector<unique_ptr<ASTUnit>> _ASTs; ///< Parsed ASTs which have not been handed out yet, indexed by source file
+    vector<DependencyList> _dependencies; ///< The files the ASTs which have not been handed out yet were built from
+    vector<bool> _parsed; ///< Flags indicating which source files have been parsed
+    unsigned _nextToParse = 0; ///< Index of the next source file a worker should parse
+    unsigned _nextToConsume = 0; ///< Index of the next source file to be handed out
+    unsigned _window; ///< The maximum number of source files the workers may parse ahead of the consumer
+    bool _started = false; ///< Set once the source list has been given to the builder
+    bool _stopping = false; ///< Set when the builder is destroyed, to stop the workers
+    
+    vector<thread> _workers;
+    mutex _mutex;
+    condition_variable _parsedCondition; ///< Signalled whenever a worker finished parsing a source file
+    condition_variable _consumedCondition; ///< Signalled whenever an AST has been handed out
+    
+    /// The main loop of a worker thread
+    void work();
+    
+    /// Check if the compile commands of all source files run in the current working directory,
+    /// in which case they can be parsed on worker threads without changing the working directory.
+    bool runsInWorkingDirectory(const SourceList &sourceFiles) const;
+    
+    /// Retrieve the PCH of the prefix header for the given compile command, building it if necessary.
+    /// \return The PCH, whose path is empty if it could not be built.
+    const PrecompiledHeader &getPrecompiledHeader(const CompileCommand &command);
+    
+    /// Precompile the prefix header into the given file, using the flags of a compile command.
+    /// \param[out] dependencies The files the PCH has been built from.
+    /// \return False if the prefix header failed to compile.
+    bool buildPrecompiledHeader(const CompileCommand &command, const string &pchPath, DependencyList &dependencies);
+    
+    /// Parse a source file using the Clang frontend, including the given PCH if it is not empty.
+    unique_ptr<ASTUnit> parseAST(const string &sourceFile, const string &pch);
+    
+    /// Load the cached AST with the given key, if the files it was built from are unchanged.
+    /// \param[out] dependencies The files the cached AST has been built from.
+    /// \return The cached AST, or nullptr if there is no valid cache entry.
+    unique_ptr<ASTUnit> loadCachedAST(const string &key, DependencyList &dependencies);
+    
+    /// Store an AST in the cache, under the given key. Failing to do so is not an error, the AST is simply not cached.
+    /// \param dependencies The files the AST has been built from, which invalidate the cache entry when changed.
+    void storeCachedAST(const string &key, ASTUnit &ast, const DependencyList &dependencies);
+    
+    /// The path of a file in the cache directory.
+    string getCachePath(const string &key, const string &extension) const;
+
+public:
+    /// Create a builder. No source files are parsed until they are given to the builder using parse().
+    /// \param compilations The compilation database.
+    /// \param options The options used to parse the source files.
+    ASTBuilder(const CompilationDatabase &compilations, const ParseOptions &options);
+    
+    ~ASTBuilder();
+    
+    ASTBuilder(const ASTBuilder &) = delete;
+    ASTBuilder &operator=(const ASTBuilder &) = delete;
+    
+    /// Start parsing a list of source files. When parsing in parallel, the workers are started here, unless a compile
+    /// command runs in a different working directory.
+    /// This method may only be called once for every builder.
+    /// \param sourceFiles The source files to parse, in the order in which the ASTs should be handed out.
+    void parse(const SourceList &sourceFiles);
+    
+    /// Retrieve the AST of the next source file in the list given to parse(), waiting for it to be parsed if necessary.
+    /// \param[out] sourceFile The path of the source file.
+    /// \param[out] ast The AST of the source file, or nullptr if it failed to parse.
+    /// \param[out] dependencies The files the AST has been built from, see buildAST().
+    /// \return False when all ASTs have been handed out, true otherwise.
+    bool next(string &sourceFile, unique_ptr<ASTUnit> &ast, DependencyList &dependencies);
+    
+    /// \brief Parse a single source file into an AST, according to the compilation database.
+    /// If the source file has a valid entry in the AST cache, the cached AST is loaded instead.
+    /// The source file does not need to be in the source list of the builder. This method may be called while
+    /// the workers are parsing the source list, as long as its compile command runs in the current working directory.
+    /// \param sourceFile The path of the source file we need to parse.
+    /// \return The generated AST, or nullptr if the source file failed to parse.
+    unique_ptr<ASTUnit> buildAST(const string &sourceFile);
+    
+    /// \brief Parse a single source file into an AST, and retrieve the files the AST has been built from.
+    /// The dependencies contain the source file and all headers it includes, including those included through the
+    /// prefix header. They are empty for serialized `.ast` inputs, whose dependencies are unknown.
+    /// \param sourceFile The path of the source file we need to parse.
+    /// \param[out] dependencies The files the AST has been built from.
+    /// \return The generated AST, or nullptr if the source file failed to parse.
+    unique_ptr<ASTUnit> buildAST(const string &sourceFile, DependencyList &dependencies);
+    
+    /// Remove the temporary PCHs built by this process. Called by the destructor, but processes forked from the process
+    /// that created the builder need to call it themselves, as they never destroy their copy of the builder.
+    /// PCHs in the AST cache are kept.
+    void removePrecompiledHeaders();
+    
+    /// Retrieve a key identifying the way a source file is compiled, i.e. its compile flags and the prefix header.
+    /// Source files compiled in the same way share the same key.
+    /// \return The key, or an empty string if the source file is not in the compilation database.
+    string getCompileCommandKey(const string &sourceFile) const;
+};
+    
+} // namespace X
+
+#endif /* ASTBuilder_hpp */
@@ -0,0 +1,94 @@
+//
+//  FileHash.cpp
+//  Framework X
+//
+//  Created by Ruben Opdebeeck on 13/06/2017.
+//  Copyright © 2017 Ruben Opdebeeck. All rights reserved.
+//
+
+#include "FileHash.hpp"
+
+#include <fstream>
+#include <algorithm>
+
+#include <llvm/Support/MemoryBuffer.h>
+#include <llvm/Support/FileSystem.h>
+
+using namespace X;
+
+string X::hashString(llvm::StringRef data) {
+    llvm::MD5 hash;
+    hash.update(data);
+    
+    llvm::MD5::MD5Result result;
+    hash.final(result);
+    
+    llvm::SmallString<32> str;
+    llvm::MD5::stringifyResult(result, str);
+    return str.str();
+}
+
+string X::hashFileContents(const string &path) {
+    auto buffer = llvm::MemoryBuffer::getFile(path);
+    if (!buffer) return "";
+    
+    return hashString((*buffer)->getBuffer());
+}
+
+DependencyList X::collectDependencies(const SourceManager &sourceManager) {
+    DependencyList dependencies;
+    
+    for (auto it = sourceManager.fileinfo_begin(); it != sourceManager.fileinfo_end(); it++) {
+        string path(it->first->getName());
+        dependencies.push_back({ path, hashFileContents(path) });
+    }
+    
+    // Keep the order stable, so identical builds produce identical dependency files
+    sort(dependencies.begin(), dependencies.end(), [](const FileDependency &a, const FileDependency &b) {
+        return a.path < b.path;
+    });
+    
+    return dependencies;
+}
+
+bool X::dependenciesUnchanged(const DependencyList &dependencies) {
+    for (const FileDependency &dep : dependencies) {
+        if (dep.hash.empty() || hashFileContents(dep.path) != dep.hash) return false;
+    }
+    
+    return true;
+}
+
+bool X::writeDependencies(const string &path, const DependencyList &dependencies) {
+    // Write to a unique temporary file first, as several processes may share the same cache
+    llvm::SmallString<128> tempPath;
+    if (llvm::sys::fs::createUniqueFile(path + "-%%%%%%%%.tmp", tempPath)) return false;
+    
+    {
+        ofstream file(tempPath.str());
+        for (const FileDependency &dep : dependencies) {
+            file << dep.hash << " " << dep.path << "\n";
+        }
+        
+        if (!file) {
+            llvm::sys::fs::remove(tempPath);
+            return false;
+        }
+    }
+    
+    return !llvm::sys::fs::rename(tempPath, path);
+}
+
+bool X::readDependencies(const string &path, DependencyList &dependencies) {
+    ifstream file(path);
+    if (!file) return false;
+    
+    string hash, depPath;
+    while (file >> hash && getline(file, depPath)) {
+        // Drop the separating space, paths themselves may contain spaces
+        if (depPath.empty() || depPath[0] != ' ') return false;
+        dependencies.push_back({ depPath.substr(1), hash });
+    }
+    
+    return file.eof();
+}
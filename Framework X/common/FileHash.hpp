@@ -0,0 +1,56 @@
+//
+//  FileHash.hpp
+//  Framework X
+//
+//  Created by Ruben Opdebeeck on 13/06/2017.
+//  Copyright © 2017 Ruben Opdebeeck. All rights reserved.
+//
+
+#ifndef FileHash_hpp
+#define FileHash_hpp
+
+#include <string>
+#include <vector>
+
+#include <clang/Frontend/ASTUnit.h>
+#include <clang/Basic/SourceManager.h>
+#include <llvm/Support/MD5.h>
+
+using namespace clang;
+using namespace std;
+
+namespace X {
+
+/// A file an AST depends on, along with the hash of its contents at the time the AST was built.
+struct FileDependency {
+    string path;
+    string hash;
+};
+
+using DependencyList = vector<FileDependency>;
+
+/// Hash a string, returning the hexadecimal representation of its MD5 digest.
+string hashString(llvm::StringRef data);
+
+/// Hash the contents of a file.
+/// \return The hexadecimal MD5 digest of the file, or an empty string if the file could not be read.
+string hashFileContents(const string &path);
+
+/// Collect the files that have been read into the given source manager, e.g. the main file and all the headers
+/// it transitively includes.
+DependencyList collectDependencies(const SourceManager &sourceManager);
+
+/// Check whether none of the dependencies have been changed or removed since they have been collected.
+bool dependenciesUnchanged(const DependencyList &dependencies);
+
+/// Write a list of dependencies to a file, one per line.
+/// \return False if the file could not be written.
+bool writeDependencies(const string &path, const DependencyList &dependencies);
+
+/// Read a list of dependencies written by writeDependencies.
+/// \return False if the file does not exist or is malformed.
+bool readDependencies(const string &path, DependencyList &dependencies);
+    
+} // namespace X
+
+#endif /* FileHash_hpp */
@@ -0,0 +1,165 @@
+//
+//  RunManifest.cpp
+//  Framework X
+//
+//  Created by Ruben Opdebeeck on 15/06/2017.
+//  Copyright © 2017 Ruben Opdebeeck. All rights reserved.
+//
+
+#include "RunManifest.hpp"
+
+#include <fstream>
+#include <algorithm>
+
+#include <llvm/Support/FileSystem.h>
+#include <llvm/Support/LockFileManager.h>
+#include <llvm/Support/raw_ostream.h>
+
+using namespace X;
+
+void X::from_json(const json &j, ManifestEntry &entry) {
+    entry = ManifestEntry();
+    entry.file = j.at("file").get<string>();
+    entry.command = j.at("command").get<string>();
+    entry.rule = j.at("rule").get<string>();
+    entry.rhs = j.at("rhs").get<string>();
+    
+    for (const json &dep : j.at("dependencies")) {
+        entry.dependencies.push_back({ dep.at("path").get<string>(), dep.at("hash").get<string>() });
+    }
+    
+    for (const json &edit : j.at("edits")) {
+        entry.edits.push_back({ edit.at("offset").get<unsigned>(), edit.at("length").get<unsigned>(),
+                                edit.at("replacement").get<string>() });
+    }
+}
+
+void X::to_json(json &j, const ManifestEntry &entry) {
+    json dependencies = json::array();
+    for (const FileDependency &dep : entry.dependencies) {
+        dependencies.push_back({ { "path", dep.path }, { "hash", dep.hash } });
+    }
+    
+    json edits = json::array();
+    for (const Edit &edit : entry.edits) {
+        edits.push_back({ { "offset", edit.offset }, { "length", edit.length }, { "replacement", edit.replacement } });
+    }
+    
+    j = json {
+        { "file", entry.file },
+        { "command", entry.command },
+        { "rule", entry.rule },
+        { "rhs", entry.rhs },
+        { "dependencies", dependencies },
+        { "edits", edits }
+    };
+}
+
+/// Read the entries of the manifest at the given path.
+/// \return False if the manifest exists but is malformed, in which case no entries are read.
+static bool readEntries(const string &path, map<pair<string, string>, ManifestEntry> &entries) {
+    ifstream file(path);
+    if (!file) return true;
+    
+    try {
+        json manifest;
+        file >> manifest;
+        for (const json &j : manifest) {
+            ManifestEntry entry(j.get<ManifestEntry>());
+            entries[{ entry.file, entry.rule }] = move(entry);
+        }
+    } catch (const exception &e) {
+        llvm::errs() << "Ignoring malformed run manifest " << path << ": " << e.what() << "\n";
+        entries.clear();
+        return false;
+    }
+    
+    return true;
+}
+
+RunManifest::RunManifest(const string &path) : _path(path) {
+    readEntries(path, _entries);
+}
+
+const ManifestEntry *RunManifest::lookup(const string &sourceFile, const string &command, const string &rule,
+                                         const string &rhs) const {
+    auto it = _entries.find({ sourceFile, rule });
+    if (it == _entries.end()) return nullptr;
+    
+    const ManifestEntry &entry(it->second);
+    if (entry.command != command || entry.rhs != rhs) return nullptr;
+    if (entry.dependencies.empty() || !dependenciesUnchanged(entry.dependencies)) return nullptr;
+    
+    return &entry;
+}
+
+void RunManifest::record(ManifestEntry entry) {
+    pair<string, string> key(entry.file, entry.rule);
+    _entries[key] = move(entry);
+    _recorded.insert(key);
+}
+
+bool RunManifest::save() const {
+    // Other runs, e.g. the other shards, may have saved the same manifest since it has been loaded. Hold its lock
+    // while merging their entries with the ones recorded in this run, so no run drops the entries of another.
+    while (true) {
+        llvm::LockFileManager lock(_path);
+        switch (lock) {
+            case llvm::LockFileManager::LFS_Error:
+                return false;
+                
+            case llvm::LockFileManager::LFS_Shared:
+                // The owner of a stale lock may have crashed, clang removes the lock in this case as well
+                if (lock.waitForUnlock() == llvm::LockFileManager::Res_Timeout) lock.unsafeRemoveLockFile();
+                continue;
+                
+            case llvm::LockFileManager::LFS_Owned:
+                break;
+        }
+        
+        map<pair<string, string>, ManifestEntry> entries;
+        readEntries(_path, entries);
+        for (const pair<string, string> &key : _recorded) {
+            entries[key] = _entries.at(key);
+        }
+        
+        json manifest = json::array();
+        for (auto &entry : entries) {
+            manifest.push_back(entry.second);
+        }
+        
+        // Write to a unique temporary file first, so an interrupted run never leaves a truncated manifest behind
+        llvm::SmallString<128> tempPath;
+        if (llvm::sys::fs::createUniqueFile(_path + "-%%%%%%%%.tmp", tempPath)) return false;
+        
+        {
+            ofstream file(tempPath.str());
+            if (!(file << manifest.dump(2) << "\n")) {
+                llvm::sys::fs::remove(tempPath);
+                return false;
+            }
+        }
+        
+        if (llvm::sys::fs::rename(tempPath, _path)) {
+            llvm::sys::fs::remove(tempPath);
+            return false;
+        }
+        
+        return true;
+    }
+}
+
+string X::applyEdits(llvm::StringRef contents, vector<Edit> edits) {
+    sort(edits.begin(), edits.end(), [](const Edit &a, const Edit &b) { return a.offset < b.offset; });
+    
+    string result;
+    unsigned pos = 0;
+    for (const Edit &edit : edits) {
+        result += contents.slice(pos, edit.offset).str();
+        result += edit.replacement;
+        pos = edit.offset + edit.length;
+    }
+    result += contents.substr(pos).str();
+    
+    return result;
+}
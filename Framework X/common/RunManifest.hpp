@@ -0,0 +1,82 @@
+//
+//  RunManifest.hpp
+//  Framework X
+//
+//  Created by Ruben Opdebeeck on 15/06/2017.
+//  Copyright © 2017 Ruben Opdebeeck. All rights reserved.
+//
+
+#ifndef RunManifest_hpp
+#define RunManifest_hpp
+
+#include <string>
+#include <vector>
+#include <map>
+#include <set>
+
+#include <json.hpp>
+
+#include "FileHash.hpp"
+
+using namespace std;
+
+namespace X {
+
+using nlohmann::json;
+
+/// A replacement of a range of characters in a source file.
+struct Edit {
+    unsigned offset; ///< The offset of the first replaced character in the file
+    unsigned length; ///< The number of replaced characters
+    string replacement;
+};
+
+/// The outcome of transforming a single source file, along with everything it depends on.
+struct ManifestEntry {
+    string file; ///< The absolute path of the source file
+    string command; ///< The key of the compile command, see ASTBuilder::getCompileCommandKey
+    string rule; ///< Hash of the LHS template configuration and the files the template has been built from
+    string rhs; ///< Hash of the RHS template
+    DependencyList dependencies; ///< The source file and all headers it includes
+    vector<Edit> edits; ///< The edits made to the source file, empty if nothing matched
+};
+
+void to_json(json &j, const ManifestEntry &entry);
+void from_json(const json &j, ManifestEntry &entry);
+
+/// \class RunManifest
+/// \brief Remembers the outcome of transforming source files across runs.
+///
+/// When a source file is transformed again using the same rule, and neither the source file, the headers it includes,
+/// its compile command nor the rule changed, the outcome is the same as in the previous run. The manifest stores
+/// the edits of that run, so they can be applied without parsing and matching the source file again.
+/// A single manifest can be shared by several rules, as the outcome for each rule is recorded separately.
+class RunManifest {
+    string _path;
+    map<pair<string, string>, ManifestEntry> _entries; ///< The entries, keyed by their source file and rule
+    set<pair<string, string>> _recorded; ///< The keys of the entries recorded in this run
+
+public:
+    /// Load the manifest at the given path. A missing manifest results in an empty one, a malformed manifest is
+    /// reported and discarded.
+    RunManifest(const string &path);
+    
+    /// Find the entry for a source file, if it is still valid for the given compile command and rule.
+    /// \return The entry, or nullptr if the source file needs to be transformed again.
+    const ManifestEntry *lookup(const string &sourceFile, const string &command, const string &rule, const string &rhs) const;
+    
+    /// Record the outcome of transforming a source file, replacing any previous entry for the same rule.
+    void record(ManifestEntry entry);
+    
+    /// Write the manifest to the path it has been loaded from. The entries recorded in this run are merged with the
+    /// ones saved by other runs in the meantime, so several shards can share a manifest.
+    /// \return False if the manifest could not be written.
+    bool save() const;
+};
+
+/// Apply a list of non-overlapping edits to the contents of a file.
+string applyEdits(llvm::StringRef contents, vector<Edit> edits);
+    
+} // namespace X
+
+#endif /* RunManifest_hpp */
@@ -0,0 +1,69 @@
+//
+//  TokenPrefilter.cpp
+//  Framework X
+//
+//  Created by Ruben Opdebeeck on 14/06/2017.
+//  Copyright © 2017 Ruben Opdebeeck. All rights reserved.
+//
+
+#include "TokenPrefilter.hpp"
+
+#include <cstring>
+#include <cctype>
+#include <algorithm>
+
+#include <llvm/Support/MemoryBuffer.h>
+
+using namespace X;
+
+TokenPrefilter::TokenPrefilter(const set<string> &tokens) {
+    for (const string &token : tokens) {
+        if (!token.empty()) _tokens.push_back(token);
+    }
+    
+    // Longer tokens tend to be rarer, so checking them first rejects most files with a single scan
+    stable_sort(_tokens.begin(), _tokens.end(), [](const string &a, const string &b) { return a.size() > b.size(); });
+}
+
+static bool isIdentifierChar(char c) {
+    return isalnum(static_cast<unsigned char>(c)) || c == '_' || c == '$';
+}
+
+/// Search a buffer for a token that is not part of a larger identifier.
+/// Candidate positions are found using memchr, which the C library implements using vector instructions.
+static bool containsToken(llvm::StringRef buffer, const string &token) {
+    const char *begin = buffer.begin();
+    const char *end = buffer.end();
+    size_t length = token.size();
+    
+    for (const char *pos = begin; size_t(end - pos) >= length; pos++) {
+        pos = static_cast<const char *>(memchr(pos, token[0], end - pos - length + 1));
+        if (!pos) return false;
+        
+        if (memcmp(pos, token.data(), length) == 0
+            && (pos == begin || !isIdentifierChar(pos[-1]))
+            && (pos + length == end || !isIdentifierChar(pos[length]))) {
+            return true;
+        }
+    }
+    
+    return false;
+}
+
+bool TokenPrefilter::mayMatch(llvm::StringRef buffer) const {
+    for (const string &token : _tokens) {
+        if (!containsToken(buffer, token)) return false;
+    }
+    
+    return true;
+}
+
+bool TokenPrefilter::mayMatch(const string &path) const {
+    if (_tokens.empty()) return true;
+    
+    // Large files are memory mapped rather than read, as most of them are rejected without looking at all of their contents
+    auto buffer = llvm::MemoryBuffer::getFile(path, -1, false);
+    if (!buffer) return true;
+    
+    return mayMatch((*buffer)->getBuffer());
+}
@@ -0,0 +1,46 @@
+//
+//  TokenPrefilter.hpp
+//  Framework X
+//
+//  Created by Ruben Opdebeeck on 14/06/2017.
+//  Copyright © 2017 Ruben Opdebeeck. All rights reserved.
+//
+
+#ifndef TokenPrefilter_hpp
+#define TokenPrefilter_hpp
+
+#include <string>
+#include <vector>
+#include <set>
+
+#include <llvm/ADT/StringRef.h>
+
+using namespace std;
+
+namespace X {
+
+/// \class TokenPrefilter
+/// \brief Decides whether a source file may contain a match, before parsing it.
+///
+/// The prefilter scans the raw contents of a source file for a set of tokens, which every match must contain.
+/// A token is only found when it is not part of a larger identifier. Tokens in comments or inactive preprocessor
+/// blocks are found as well, so the prefilter never rejects a file that may contain a match, but may accept a file
+/// that does not.
+class TokenPrefilter {
+    vector<string> _tokens;
+
+public:
+    /// Create a prefilter requiring all of the given tokens. Without tokens, every file is accepted.
+    TokenPrefilter(const set<string> &tokens);
+    
+    /// Check whether a source file contains all required tokens.
+    /// Files which cannot be read are accepted, so their errors are reported when they are parsed.
+    bool mayMatch(const string &path) const;
+    
+    /// Check whether a buffer contains all required tokens.
+    bool mayMatch(llvm::StringRef buffer) const;
+};
+    
+} // namespace X
+
+#endif /* TokenPrefilter_hpp */
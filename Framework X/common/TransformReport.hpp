@@ -0,0 +1,60 @@
+//
+//  TransformReport.hpp
+//  Framework X
+//
+//  Created by Ruben Opdebeeck on 16/06/2017.
+//  Copyright © 2017 Ruben Opdebeeck. All rights reserved.
+//
+
+#ifndef TransformReport_hpp
+#define TransformReport_hpp
+
+#include <json.hpp>
+
+namespace X {
+
+using nlohmann::json;
+
+/// Statistics on a template-based transformation.
+/// Reports of transformations of disjoint parts of the source files can be merged into a single report.
+struct TransformReport {
+    unsigned filesTransformed = 0; ///< Source files which have been parsed and matched
+    unsigned filesReused = 0; ///< Source files whose edits have been taken from the run manifest
+    unsigned filesFiltered = 0; ///< Source files which have been skipped by the prefilter
+    unsigned filesFailed = 0; ///< Source files which failed to parse
+    unsigned filesChanged = 0; ///< Source files which have been edited
+    unsigned matches = 0; ///< The total number of matches
+    
+    void merge(const TransformReport &other) {
+        filesTransformed += other.filesTransformed;
+        filesReused += other.filesReused;
+        filesFiltered += other.filesFiltered;
+        filesFailed += other.filesFailed;
+        filesChanged += other.filesChanged;
+        matches += other.matches;
+    }
+};
+
+inline void to_json(json &j, const TransformReport &report) {
+    j = json {
+        { "filesTransformed", report.filesTransformed },
+        { "filesReused", report.filesReused },
+        { "filesFiltered", report.filesFiltered },
+        { "filesFailed", report.filesFailed },
+        { "filesChanged", report.filesChanged },
+        { "matches", report.matches }
+    };
+}
+
+inline void from_json(const json &j, TransformReport &report) {
+    report.filesTransformed = j.at("filesTransformed").get<unsigned>();
+    report.filesReused = j.at("filesReused").get<unsigned>();
+    report.filesFiltered = j.at("filesFiltered").get<unsigned>();
+    report.filesFailed = j.at("filesFailed").get<unsigned>();
+    report.filesChanged = j.at("filesChanged").get<unsigned>();
+    report.matches = j.at("matches").get<unsigned>();
+}
+    
+} // namespace X
+
+#endif /* TransformReport_hpp */
@@ -0,0 +1,292 @@
+//
+//  WorkerPool.cpp
+//  Framework X
+//
+//  Created by Ruben Opdebeeck on 17/06/2017.
+//  Copyright © 2017 Ruben Opdebeeck. All rights reserved.
+//
+
+#include "WorkerPool.hpp"
+
+#include <chrono>
+#include <cerrno>
+#include <cstring>
+#include <csignal>
+#include <fstream>
+
+#include <poll.h>
+#include <sys/wait.h>
+
+#include <llvm/Support/raw_ostream.h>
+
+using namespace X;
+
+/// The current time in seconds, on a monotonic clock.
+static double now() {
+    return chrono::duration<double>(chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static bool writeAll(int fd, const void *data, size_t size) {
+    const char *bytes = static_cast<const char *>(data);
+    while (size > 0) {
+        ssize_t count = write(fd, bytes, size);
+        if (count < 0 && errno == EINTR) continue;
+        if (count <= 0) return false;
+        bytes += count;
+        size -= count;
+    }
+    return true;
+}
+
+static bool readExactly(int fd, void *data, size_t size) {
+    char *bytes = static_cast<char *>(data);
+    while (size > 0) {
+        ssize_t count = read(fd, bytes, size);
+        if (count < 0 && errno == EINTR) continue;
+        if (count <= 0) return false;
+        bytes += count;
+        size -= count;
+    }
+    return true;
+}
+
+/// Retrieve the resident set size of a process in megabytes, or 0 if it cannot be determined.
+static unsigned long residentMegabytes(pid_t pid) {
+    ifstream statm("/proc/" + to_string(pid) + "/statm");
+    unsigned long size, resident;
+    if (!(statm >> size >> resident)) return 0;
+    
+    return resident * sysconf(_SC_PAGESIZE) / (1024 * 1024);
+}
+
+/// Describe the way a worker process ended, given its wait status.
+static string describeExit(int status) {
+    if (WIFSIGNALED(status)) return "worker crashed with signal " + to_string(WTERMSIG(status)) + " (" + strsignal(WTERMSIG(status)) + ")";
+    if (WIFEXITED(status)) return "worker exited with status " + to_string(WEXITSTATUS(status));
+    return "worker stopped unexpectedly";
+}
+
+WorkerPool::WorkerPool(unsigned size, WorkerLimits limits, Task task, function<void()> onExit)
+    : _size(max(size, 1u)), _limits(limits), _task(task), _onExit(onExit) {}
+
+WorkerPool::~WorkerPool() {
+    for (Worker &worker : _workers) {
+        terminate(worker);
+    }
+}
+
+bool WorkerPool::spawn(Worker &worker) {
+    int taskPipe[2], resultPipe[2];
+    if (pipe(taskPipe) != 0) return false;
+    if (pipe(resultPipe) != 0) {
+        close(taskPipe[0]);
+        close(taskPipe[1]);
+        return false;
+    }
+    
+    // Make sure no buffered output gets duplicated into the worker
+    llvm::outs().flush();
+    llvm::errs().flush();
+    
+    pid_t pid = fork();
+    if (pid < 0) {
+        close(taskPipe[0]);
+        close(taskPipe[1]);
+        close(resultPipe[0]);
+        close(resultPipe[1]);
+        return false;
+    }
+    
+    if (pid == 0) {
+        close(taskPipe[1]);
+        close(resultPipe[0]);
+        
+        // Don't keep the pipes of the other workers open, otherwise they won't notice when this process goes away
+        for (Worker &other : _workers) {
+            if (other.taskFd >= 0) close(other.taskFd);
+            if (other.resultFd >= 0) close(other.resultFd);
+        }
+        
+        serve(taskPipe[0], resultPipe[1]);
+    }
+    
+    close(taskPipe[0]);
+    close(resultPipe[1]);
+    
+    worker = Worker();
+    worker.pid = pid;
+    worker.taskFd = taskPipe[1];
+    worker.resultFd = resultPipe[0];
+    return true;
+}
+
+int WorkerPool::terminate(Worker &worker) {
+    int status = 0;
+    if (worker.pid < 0) return status;
+    
+    // An idle worker exits once it notices there are no more tasks, a busy worker needs to be stopped
+    if (worker.task >= 0) kill(worker.pid, SIGKILL);
+    close(worker.taskFd);
+    close(worker.resultFd);
+    
+    while (waitpid(worker.pid, &status, 0) < 0 && errno == EINTR);
+    
+    worker = Worker();
+    return status;
+}
+
+void WorkerPool::serve(int taskFd, int resultFd) {
+    uint32_t task;
+    while (readExactly(taskFd, &task, sizeof(task))) {
+        string result;
+        try {
+            result = _task(task);
+        } catch (const exception &e) {
+            llvm::errs() << e.what() << "\n";
+            llvm::errs().flush();
+            _exit(1);
+        }
+        
+        uint64_t size = result.size();
+        if (!writeAll(resultFd, &size, sizeof(size)) || !writeAll(resultFd, result.data(), result.size())) break;
+    }
+    
+    if (_onExit) _onExit();
+    llvm::outs().flush();
+    llvm::errs().flush();
+    _exit(0);
+}
+
+void WorkerPool::run(unsigned taskCount, ResultHandler onResult, FailureHandler onFailure) {
+    if (taskCount == 0) return;
+    
+    deque<unsigned> pending;
+    for (unsigned i = 0; i < taskCount; i++) {
+        pending.push_back(i);
+    }
+    vector<unsigned> attempts(taskCount, 0);
+    unsigned remaining = taskCount;
+    
+    // Retry the task of a worker that has been stopped, or give up on it
+    auto retry = [&](unsigned task, const string &reason) {
+        if (++attempts[task] > _limits.retries) {
+            onFailure(task, reason);
+            remaining--;
+        } else {
+            pending.push_front(task);
+        }
+    };
+    
+    // Writing a task to a worker that just died must not take down this process
+    auto previousHandler = signal(SIGPIPE, SIG_IGN);
+    _workers.resize(min(_size, taskCount));
+    
+    while (remaining > 0) {
+        // Hand out tasks to the idle workers, replacing workers that are gone or have served long enough
+        for (Worker &worker : _workers) {
+            if (pending.empty()) break;
+            if (worker.task >= 0) continue;
+            
+            if (worker.pid < 0 || (_limits.recycleAfter && worker.served >= _limits.recycleAfter)) {
+                terminate(worker);
+                if (!spawn(worker)) {
+                    llvm::errs() << "Unable to start a worker process\n";
+                    continue;
+                }
+            }
+            
+            uint32_t task = pending.front();
+            if (!writeAll(worker.taskFd, &task, sizeof(task))) {
+                // The worker died while idle, replace it on the next round
+                terminate(worker);
+                continue;
+            }
+            
+            pending.pop_front();
+            worker.task = task;
+            worker.deadline = _limits.timeout ? now() + _limits.timeout : 0;
+        }
+        
+        vector<pollfd> fds;
+        vector<Worker *> busy;
+        for (Worker &worker : _workers) {
+            if (worker.task < 0) continue;
+            fds.push_back({ worker.resultFd, POLLIN, 0 });
+            busy.push_back(&worker);
+        }
+        
+        // Without any running worker, we are unable to start new ones
+        if (busy.empty()) {
+            for (unsigned task : pending) {
+                onFailure(task, "unable to start a worker process");
+            }
+            break;
+        }
+        
+        // Wake up in time for the first deadline, and regularly to check the memory usage of the workers
+        int waitTime = _limits.memoryLimit ? 100 : -1;
+        for (Worker *worker : busy) {
+            if (!worker->deadline) continue;
+            int untilDeadline = max(0, int((worker->deadline - now()) * 1000) + 1);
+            waitTime = waitTime < 0 ? untilDeadline : min(waitTime, untilDeadline);
+        }
+        
+        if (poll(fds.data(), fds.size(), waitTime) < 0 && errno != EINTR) {
+            llvm::errs() << "Unable to wait for the worker processes: " << strerror(errno) << "\n";
+            break;
+        }
+        
+        for (unsigned i = 0; i < fds.size(); i++) {
+            Worker &worker(*busy[i]);
+            if (!(fds[i].revents & (POLLIN | POLLHUP | POLLERR))) continue;
+            
+            char buffer[65536];
+            ssize_t count = read(worker.resultFd, buffer, sizeof(buffer));
+            if (count < 0 && errno == EINTR) continue;
+            
+            // The worker went away before reporting its result
+            if (count <= 0) {
+                unsigned task = worker.task;
+                worker.task = -1; // Already stopped, no need to kill it
+                retry(task, describeExit(terminate(worker)));
+                continue;
+            }
+            
+            worker.buffer.append(buffer, count);
+            
+            // Results are prefixed by their size
+            uint64_t size;
+            if (worker.buffer.size() < sizeof(size)) continue;
+            memcpy(&size, worker.buffer.data(), sizeof(size));
+            if (worker.buffer.size() < sizeof(size) + size) continue;
+            
+            unsigned task = worker.task;
+            string result(worker.buffer.substr(sizeof(size), size));
+            worker.buffer.clear();
+            worker.task = -1;
+            worker.served++;
+            remaining--;
+            onResult(task, result);
+        }
+        
+        // Stop the workers exceeding their limits
+        double currentTime = now();
+        for (Worker *worker : busy) {
+            if (worker->task < 0) continue;
+            
+            unsigned task = worker->task;
+            if (worker->deadline && currentTime >= worker->deadline) {
+                terminate(*worker);
+                retry(task, "timed out after " + to_string(_limits.timeout) + " seconds");
+            } else if (_limits.memoryLimit && residentMegabytes(worker->pid) > _limits.memoryLimit) {
+                terminate(*worker);
+                retry(task, "exceeded the memory limit of " + to_string(_limits.memoryLimit) + " MB");
+            }
+        }
+    }
+    
+    for (Worker &worker : _workers) {
+        terminate(worker);
+    }
+    signal(SIGPIPE, previousHandler);
+}
@@ -0,0 +1,102 @@
+//
+//  WorkerPool.hpp
+//  Framework X
+//
+//  Created by Ruben Opdebeeck on 17/06/2017.
+//  Copyright © 2017 Ruben Opdebeeck. All rights reserved.
+//
+
+#ifndef WorkerPool_hpp
+#define WorkerPool_hpp
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <functional>
+
+#include <unistd.h>
+#include <sys/types.h>
+
+using namespace std;
+
+namespace X {
+
+/// Limits imposed on the worker processes of a WorkerPool.
+struct WorkerLimits {
+    unsigned timeout = 0; ///< The maximum number of seconds a single task may take, 0 for no limit
+    unsigned memoryLimit = 0; ///< The maximum resident set size of a worker in megabytes, 0 for no limit
+    unsigned recycleAfter = 0; ///< The number of tasks after which a worker is replaced by a fresh one, 0 to never recycle
+    unsigned retries = 1; ///< The number of times a task is retried after its worker crashed or exceeded a limit
+};
+
+/// \class WorkerPool
+/// \brief Runs tasks in a pool of forked worker processes, isolating the caller from crashes and memory blow-ups.
+///
+/// Workers are forked from the calling process, so they inherit all of its state, e.g. a parsed template.
+/// Every worker runs one task at a time, and reports its result back through a pipe. A worker that crashes, takes
+/// longer than the timeout or uses more memory than allowed is killed and replaced, and its task is retried on
+/// another worker until it runs out of retries. Workers are recycled after a number of tasks, returning all of
+/// their memory to the operating system.
+///
+/// The memory limit relies on /proc to determine the resident set size of the workers, and is ignored on platforms
+/// without it. Note that the calling process should not run any other threads when the pool is running, as only the
+/// forking thread is duplicated into the workers.
+class WorkerPool {
+public:
+    /// A task, run inside a worker process, which returns its result as a string.
+    using Task = function<string(unsigned)>;
+    
+    /// Called in the calling process with the result of a task.
+    using ResultHandler = function<void(unsigned, const string &)>;
+    
+    /// Called in the calling process when a task has failed too many times, with the reason of the last failure.
+    using FailureHandler = function<void(unsigned, const string &)>;
+
+private:
+    struct Worker {
+        pid_t pid = -1;
+        int taskFd = -1; ///< Write end of the pipe used to send tasks to the worker
+        int resultFd = -1; ///< Read end of the pipe used to receive results from the worker
+        int task = -1; ///< The task the worker is running, or -1 if idle
+        double deadline = 0; ///< The time at which the current task times out
+        unsigned served = 0; ///< The number of tasks the worker has finished
+        string buffer; ///< The part of the result received so far
+    };
+    
+    unsigned _size;
+    WorkerLimits _limits;
+    Task _task;
+    function<void()> _onExit;
+    vector<Worker> _workers;
+    
+    /// Fork a new worker process.
+    bool spawn(Worker &worker);
+    
+    /// Stop a worker process and wait for it. An idle worker is asked to exit, a busy one is killed.
+    /// \return The wait status of the worker process.
+    int terminate(Worker &worker);
+    
+    /// The main loop of a worker process. Never returns.
+    [[noreturn]] void serve(int taskFd, int resultFd);
+
+public:
+    /// Create a pool, without starting any workers yet.
+    /// \param size The number of worker processes.
+    /// \param limits The limits imposed on the workers.
+    /// \param task The task run by the workers.
+    /// \param onExit Called inside a worker process before it exits, e.g. to clean up temporary files.
+    WorkerPool(unsigned size, WorkerLimits limits, Task task, function<void()> onExit = nullptr);
+    
+    ~WorkerPool();
+    
+    WorkerPool(const WorkerPool &) = delete;
+    WorkerPool &operator=(const WorkerPool &) = delete;
+    
+    /// Run tasks 0 up to taskCount on the workers, and wait for all of them to finish or fail.
+    /// Results are reported as they come in, which need not be the order of the tasks.
+    void run(unsigned taskCount, ResultHandler onResult, FailureHandler onFailure);
+};
+    
+} // namespace X
+
+#endif /* WorkerPool_hpp */
@@ -8,17 +8,48 @@
 
 #include "X.hpp"
 
+/// Write the contents of an output file to a temporary file next to it first, which is then renamed into place.
+/// This way, a worker that is killed while writing never leaves a truncated source file behind.
+/// \return False if the output file could not be written.
+static bool writeOutputFile(const string &filename, StringRef contents) {
+    llvm::SmallString<128> tempPath;
+    if (llvm::sys::fs::createUniqueFile(filename + "-%%%%%%%%.tmp", tempPath)) return false;
+    
+    {
+        ofstream file(tempPath.str());
+        if (!file.write(contents.data(), contents.size())) {
+            llvm::sys::fs::remove(tempPath);
+            return false;
+        }
+    }
+    
+    if (llvm::sys::fs::rename(tempPath, filename)) {
+        llvm::sys::fs::remove(tempPath);
+        return false;
+    }
+    
+    return true;
+}
+
 class InternalCallback : public XCallback {
     RHSTemplate &_tmpl;
     bool _overwrite;
+    vector<Edit> _edits; ///< The edits made to the main file since the last call to takeEdits
     
 public:
     InternalCallback(RHSTemplate &tmpl, bool overwrite) : _tmpl(tmpl), _overwrite(overwrite) {}
     
     // Keep the default setRewriter implementation
     
-    void fileProcessed(FileID fid, string filename) override {
-        
+    /// Retrieve the edits made to the main file of the current rewriter, and start a new list.
+    vector<Edit> takeEdits() {
+        vector<Edit> edits;
+        swap(edits, _edits);
+        return edits;
+    }
+    
+    /// Retrieve the name of the file the transformed contents of a source file are written to.
+    string getOutputFile(string filename) {
         // Replace the file extension with ".transformed.cpp" (or "cc" or any other, depending on the original extension)
         // when we shouldn't overwrite the source files
         if (!_overwrite) {
@@ -31,11 +62,36 @@ public:
             filename = filenameStream.str();
         }
         
-        // .write() method of edit buffer only accepts LLVM's raw_ostream,
-        // so create a normal output file stream and encapsulate that in an llvm::raw_ostream
-        ofstream outFile(filename);
-        llvm::raw_os_ostream llvmStream(outFile);
-        _pRewriter->getEditBuffer(fid).write(llvmStream);
+        return filename;
+    }
+    
+    /// Write the transformed contents of a source file without parsing it, by applying a list of known edits.
+    void writeEdits(string filename, const vector<Edit> &edits) {
+        auto contents = llvm::MemoryBuffer::getFile(filename);
+        if (!contents) {
+            llvm::errs() << "Unable to read " << filename << "\n";
+            return;
+        }
+        
+        string transformed(applyEdits((*contents)->getBuffer(), edits));
+        string outputFile(getOutputFile(filename));
+        if (!writeOutputFile(outputFile, transformed)) {
+            llvm::errs() << "Unable to write " << outputFile << "\n";
+        }
+    }
+    
+    void fileProcessed(FileID fid, string filename) override {
+        filename = getOutputFile(filename);
+        
+        // .write() method of edit buffer only accepts LLVM's raw_ostream, so render it into a string first
+        string transformed;
+        llvm::raw_string_ostream transformedStream(transformed);
+        _pRewriter->getEditBuffer(fid).write(transformedStream);
+        transformedStream.flush();
+        
+        if (!writeOutputFile(filename, transformed)) {
+            llvm::errs() << "Unable to write " << filename << "\n";
+        }
     }
     
     void run(const MatchFinder::MatchResult& res) override {
@@ -76,38 +132,77 @@ public:
             sr.setEnd(trailingSemiLoc);
         }
         
-        _pRewriter->ReplaceText(sr, _tmpl.instantiate(res, sm));
+        string replacement(_tmpl.instantiate(res, sm));
+        
+        // Remember where the main file was edited, so the edit can be replayed in later runs
+        bool inMainFile = sr.getBegin().isFileID() && sm.isInMainFile(sr.getBegin());
+        unsigned offset = inMainFile ? sm.getFileOffset(sr.getBegin()) : 0;
+        int length = inMainFile ? _pRewriter->getRangeSize(sr) : -1;
+        
+        if (!_pRewriter->ReplaceText(sr, replacement) && length >= 0) {
+            _edits.push_back({ offset, unsigned(length), replacement });
+        }
     }
 };
 
-using ASTList = vector<unique_ptr<ASTUnit>>;
-
-/// \brief Parse the given source files into ASTs, according to the compilation database. Parsed ASTs are inserted into the last parameter.
-///
-/// Uses a ClangTool to easily parse ASTs, so we do not have to worry about parsing command line options from the compilation database.
-/// \param sourceFiles The paths of the source files we need to parse.
-/// \param compilations The compilation database
-/// \param[out] ASTs The list of generated ASTs.
-static void buildASTs(const SourceList &sourceFiles, const CompilationDatabase &compilations, ASTList &ASTs) {
-    ClangTool ASTParserTool(compilations, sourceFiles);
-    ASTParserTool.buildASTs(ASTs);
+/// \brief Rewrite all matches found in an AST and write the transformed file.
+/// \param cb The callback used to rewrite the matches.
+/// \param res The matches for a single AST.
+static void rewriteMatches(InternalCallback &cb, ASTResult &res) {
+    cb.setRewriter(llvm::make_unique<Rewriter>(res.ast->getSourceManager(), res.ast->getLangOpts()));
+    for (MatchResult &match : res.matches) {
+        cb.run(match);
+    }
+    cb.fileProcessed(res.ast->getSourceManager().getMainFileID(), res.ast->getMainFileName());
 }
 
-/// \brief Consume the ASTs using the given consumer. Will assign a new rewriter to the callback for each file,
-/// and notify the callback when the file is completed.
+/// \class MatchingAction
+/// \brief Frontend action running a match finder on each source file, right after it has been parsed.
 ///
-/// The callback must be given a new rewriter on each new source file, as the rewriter cannot seem to handle multiple files too well.
-/// The consumer will be notified using its `HandleTranslationUnit` method.
-/// \param ASTs The list of ASTs to consume. Will be matched in the order presented.
-/// \param consumer The AST consumer which does the matching on this AST.
-/// \note Templated to accept both unique_ptr and shared_ptr
-template <typename smart_ptr>
-static void consumeASTs(vector<smart_ptr> &ASTs, unique_ptr<ASTConsumer> consumer, XCallback &cb) {
-    for (auto &AST : ASTs) {
-        cb.setRewriter(llvm::make_unique<Rewriter>(AST->getSourceManager(), AST->getLangOpts()));
-        consumer->HandleTranslationUnit(AST->getASTContext());
-        cb.fileProcessed(AST->getSourceManager().getMainFileID(), AST->getMainFileName());
+/// The callback is given a new rewriter on each new source file, as the rewriter cannot seem to handle multiple files too well,
+/// and it is notified when the file is completed. The AST of a source file is released by the ClangTool once the action
+/// finishes, before the next source file is parsed.
+class MatchingAction : public ASTFrontendAction {
+    MatchFinder &_finder;
+    XCallback &_cb;
+    
+public:
+    MatchingAction(MatchFinder &finder, XCallback &cb) : _finder(finder), _cb(cb) {}
+    
+    unique_ptr<ASTConsumer> CreateASTConsumer(CompilerInstance &CI, StringRef file) override {
+        _cb.setRewriter(llvm::make_unique<Rewriter>(CI.getSourceManager(), CI.getLangOpts()));
+        return _finder.newASTConsumer();
+    }
+    
+    void EndSourceFileAction() override {
+        SourceManager &sm(getCompilerInstance().getSourceManager());
+        _cb.fileProcessed(sm.getMainFileID(), sm.getFileEntryForID(sm.getMainFileID())->getName());
+    }
+};
+
+/// \class MatchingActionFactory
+/// \brief Creates a MatchingAction for every source file the ClangTool processes.
+class MatchingActionFactory : public FrontendActionFactory {
+    MatchFinder &_finder;
+    XCallback &_cb;
+    
+public:
+    MatchingActionFactory(MatchFinder &finder, XCallback &cb) : _finder(finder), _cb(cb) {}
+    
+    FrontendAction *create() override {
+        return new MatchingAction(_finder, _cb);
     }
+};
+
+/// \brief Match each source file while it is being parsed, one source file at a time.
+/// \param sourceFiles The source files to match, in the order in which they are matched.
+/// \param compilations The compilation database.
+/// \param finder The match finder, which reports its matches to the callback.
+/// \param cb The callback, which is notified of new source files.
+static void matchSourceFiles(const SourceList &sourceFiles, const CompilationDatabase &compilations, MatchFinder &finder, XCallback &cb) {
+    ClangTool tool(compilations, sourceFiles);
+    MatchingActionFactory factory(finder, cb);
+    tool.run(&factory);
 }
 
 // Many types of Matchers, so use a template to support them all
@@ -115,94 +210,384 @@ template <typename MatcherType>
 void X::transform(const SourceList &sourceFiles, const CompilationDatabase &compilations, MatcherType &matcher,
                   string rhs, bool overwriteChangedFiles) {
     
-    // Parse the source files to ASTs using a ClangTool
-    ASTList ASTs;
-    buildASTs(sourceFiles, compilations, ASTs);
-    
     // Set up the matching
     RHSTemplate rhsTemplate(rhs);
     MatchFinder finder;
     InternalCallback cb(rhsTemplate, overwriteChangedFiles);
     finder.addMatcher(matcher, &cb);
     
-    // Match the ASTs
-    consumeASTs(ASTs, finder.newASTConsumer(), cb);
+    // Parse and match the source files using a ClangTool
+    matchSourceFiles(sourceFiles, compilations, finder, cb);
 }
 
 template <typename MatcherType>
 void X::transform(const SourceList &sourceFiles, const CompilationDatabase &compilations, MatcherType &matcher, XCallback &cb) {
     
-    ASTList ASTs;
-    buildASTs(sourceFiles, compilations, ASTs);
     MatchFinder finder;
     finder.addMatcher(matcher, &cb);
     
-    consumeASTs(ASTs, finder.newASTConsumer(), cb);
+    matchSourceFiles(sourceFiles, compilations, finder, cb);
 }
 
-void X::transform(SourceList sourceFiles, const CompilationDatabase &compilations, string LHSTemplateConfigFile) {
-    LHSConfiguration lhsConfig(LHSTemplateConfigFile);
+/// The outcome of transforming a part of the source files.
+struct ShardResult {
+    TransformReport report;
+    vector<ManifestEntry> entries; ///< New entries for the run manifest
+};
+
+static void to_json(json &j, const ShardResult &result) {
+    j = json { { "report", result.report }, { "entries", result.entries } };
+}
+
+static void from_json(const json &j, ShardResult &result) {
+    result.report = j.at("report").get<TransformReport>();
+    result.entries = j.at("entries").get<vector<ManifestEntry>>();
+}
+
+/// \brief Transform a part of the source files, which does not include the template source.
+/// \param sourceFiles The source files to be transformed, without the template source.
+/// \param compilations The compilation database.
+/// \param lhsConfig The LHS template configuration.
+/// \param LHSTemplateConfigFile The path to the LHS template configuration file.
+/// \param options Options for the transformation.
+/// \param manifest The manifest of the previous run, or nullptr if no manifest is used.
+/// \param ownsTemplateSource True if this part is responsible for transforming the template source, if needed.
+/// \return The statistics of the transformation, and the manifest entries of the transformed source files.
+static ShardResult transformShard(SourceList sourceFiles, const CompilationDatabase &compilations, LHSConfiguration &lhsConfig,
+                                  const string &LHSTemplateConfigFile, const TransformOptions &options,
+                                  const RunManifest *manifest, bool ownsTemplateSource) {
+    ShardResult result;
+    TransformReport &report(result.report);
+    string templateSource(lhsConfig.getTemplateSource());
     
-    // Ensure the template source file also gets parsed
-    if (find(sourceFiles.begin(), sourceFiles.end(), lhsConfig.getTemplateSource()) != sourceFiles.end()
-        && compilations.getCompileCommands(lhsConfig.getTemplateSource()).empty()) {
-        llvm::errs() << "Template source file is not contained in the source list or the compilation database!\n";
-        return;
+    // Parse the template source first, the template decides which source files need to be parsed.
+    // Its AST is the only one that is kept alive for the whole run, as the LHS template refers to the nodes inside of it.
+    // It is parsed through the same builder as the other source files, so it shares the precompiled prefix header.
+    ASTBuilder builder(compilations, options);
+    DependencyList templateDependencies;
+    shared_ptr<ASTUnit> templateSourceAST(builder.buildAST(templateSource, templateDependencies));
+    
+    if (!templateSourceAST) {
+        llvm::errs() << "Template source file failed to parse\n";
+        return result;
     }
     
-    // Parse to ASTs
-    // Parse the ASTs and convert the AST list from unique_ptrs to shared_ptrs as one of the ASTs (the template source)
-    // may need to be shared across the AST consumer and the LHS template
-    // It might be more efficient to not convert the smart pointers in case the AST does not need to be shared,
-    // but that incurs more overhead for allowing multiple possible types, forcing us to use even more (C++) templates
-    // While doing this, also verify that the template source was parsed correctly and save the pointer for later usage.
-    vector<shared_ptr<ASTUnit>> ASTs;
-    shared_ptr<ASTUnit> templateSourceAST;
-    bool templateSourceParsed = false;
+    LHSParserConsumer consumer(lhsConfig);
+    consumer.HandleTranslationUnit(templateSourceAST->getASTContext());
     
-    // Use a new scope so we don't confuse the shared and unique pointer AST lists
-    {
-        ASTList UniqueASTs;
-        buildASTs(sourceFiles, compilations, UniqueASTs);
+    unique_ptr<LHSTemplate> lhs(consumer.retrieveLHSTemplate());
+    
+    RHSTemplate rhs(lhsConfig.getRHSTemplate());
+    InternalCallback cb(rhs, lhsConfig.shouldOverwriteSourceFiles());
+    
+    if (ownsTemplateSource && lhsConfig.shouldTransformTemplateSource()) {
+        for (ASTResult &res : lhs->matchAST({ templateSourceAST })) {
+            rewriteMatches(cb, res);
+        }
+        cb.takeEdits();
+    }
+    
+    // Source files whose outcome is known from a previous run with the same rule don't need to be parsed again,
+    // the edits of that run are simply applied again.
+    string ruleHash, rhsHash;
+    if (manifest) {
+        // The rule consists of the configuration and the template, which may depend on headers as well.
+        // The template source is parsed with the prefix header, so changes to it affect the template as well.
+        string rule(hashFileContents(LHSTemplateConfigFile) + '\0' + builder.getCompileCommandKey(templateSource));
+        if (!options.prefixHeader.empty()) {
+            string prefixHeader(getAbsolutePath(options.prefixHeader));
+            rule += '\0' + prefixHeader + '\0' + hashFileContents(prefixHeader);
+        }
+        for (const FileDependency &dep : templateDependencies) {
+            rule += '\0' + dep.path + '\0' + dep.hash;
+        }
+        ruleHash = hashString(rule);
+        rhsHash = hashFileContents(lhsConfig.getRHSTemplate());
         
-        for (auto &uniqueAST : UniqueASTs) {
-            shared_ptr<ASTUnit> sharedAST(move(uniqueAST));
+        sourceFiles.erase(remove_if(sourceFiles.begin(), sourceFiles.end(), [&](const string &file) {
+            if (isASTFile(file)) return false;
             
-            if (sharedAST->getMainFileName() == lhsConfig.getTemplateSource()) {
-                templateSourceParsed = true;
-                templateSourceAST = sharedAST;
-                
-                // If we don't want to transform the template, don't add it now
-                if (!lhsConfig.shouldTransformTemplateSource()) continue;
-            }
+            string path(getAbsolutePath(file));
+            const ManifestEntry *entry = manifest->lookup(path, builder.getCompileCommandKey(path), ruleHash, rhsHash);
+            if (!entry) return false;
             
-            ASTs.push_back(sharedAST);
+            if (!entry->edits.empty()) {
+                cb.writeEdits(path, entry->edits);
+                report.filesChanged++;
+            }
+            report.filesReused++;
+            return true;
+        }), sourceFiles.end());
+    }
+    
+    // Source files that do not contain the identifiers of the template cannot match, so they don't need to be parsed.
+    // Serialized ASTs have already been parsed, so there is nothing to gain for them.
+    if (options.prefilter) {
+        TokenPrefilter prefilter(lhs->getRequiredTokens(templateSourceAST->getSourceManager()));
+        size_t before = sourceFiles.size();
+        sourceFiles.erase(remove_if(sourceFiles.begin(), sourceFiles.end(),
+                                    [&prefilter](const string &file) { return !isASTFile(file) && !prefilter.mayMatch(file); }),
+                          sourceFiles.end());
+        report.filesFiltered += before - sourceFiles.size();
+    }
+    
+    // Match, rewrite and write a single parsed source file
+    auto transformAST = [&](const string &sourceFile, shared_ptr<ASTUnit> ast, const DependencyList &dependencies,
+                            ShardResult &fileResult) {
+        if (!ast) {
+            llvm::errs() << "Failed to parse " << sourceFile << "\n";
+            fileResult.report.filesFailed++;
+            return;
+        }
+        
+        fileResult.report.filesTransformed++;
+        for (ASTResult &res : lhs->matchAST({ ast })) {
+            fileResult.report.matches += res.matches.size();
+            rewriteMatches(cb, res);
+        }
+        
+        vector<Edit> edits(cb.takeEdits());
+        if (!edits.empty()) fileResult.report.filesChanged++;
+        
+        // Serialized ASTs have no known dependencies, so they are always transformed again
+        if (manifest && !dependencies.empty()) {
+            string path(getAbsolutePath(sourceFile));
+            fileResult.entries.push_back({ path, builder.getCompileCommandKey(path), ruleHash, rhsHash, dependencies, edits });
         }
+    };
+    
+    // In isolated mode, every source file is parsed and matched in a worker process, so a crash or a source file
+    // that takes too much time or memory only costs us that source file. The workers are forked after the template
+    // has been built, so they don't need to build it again.
+    if (options.isolate) {
+        WorkerPool pool(options.processes, options.workerLimits, [&](unsigned idx) {
+            ShardResult fileResult;
+            DependencyList dependencies;
+            shared_ptr<ASTUnit> ast(builder.buildAST(sourceFiles[idx], dependencies));
+            transformAST(sourceFiles[idx], ast, dependencies, fileResult);
+            return json(fileResult).dump();
+        }, [&builder] { builder.removePrecompiledHeaders(); });
+        
+        vector<ShardResult> fileResults(sourceFiles.size());
+        auto onFailure = [&](unsigned idx, const string &reason) {
+            llvm::errs() << "Skipping " << sourceFiles[idx] << ": " << reason << "\n";
+            fileResults[idx] = ShardResult();
+            fileResults[idx].report.filesFailed++;
+        };
+        
+        pool.run(sourceFiles.size(), [&](unsigned idx, const string &output) {
+            try {
+                fileResults[idx] = json::parse(output).get<ShardResult>();
+            } catch (const exception &e) {
+                onFailure(idx, string("malformed result, ") + e.what());
+            }
+        }, onFailure);
+        
+        // Merge in the order of the source files, so the result does not depend on the scheduling of the workers
+        for (ShardResult &fileResult : fileResults) {
+            report.merge(fileResult.report);
+            result.entries.insert(result.entries.end(), fileResult.entries.begin(), fileResult.entries.end());
+        }
+        
+        return result;
     }
     
-    if (!templateSourceParsed) {
-        llvm::errs() << "Template source file failed to parse\n";
-        return;
+    // The remaining source files are streamed through the pipeline, one translation unit at a time.
+    // Each AST is matched, rewritten and written before the next one is handed out, and it is
+    // released as soon as we're done with it. This way, the peak memory usage is bounded by the largest
+    // translation units, rather than by the sum of all translation units.
+    // The builder may parse a number of files ahead on worker threads, but it hands them out in order.
+    builder.parse(sourceFiles);
+    string sourceFile;
+    unique_ptr<ASTUnit> parsedAST;
+    DependencyList dependencies;
+    while (builder.next(sourceFile, parsedAST, dependencies)) {
+        transformAST(sourceFile, move(parsedAST), dependencies, result);
     }
     
-    LHSParserConsumer consumer(lhsConfig);
-    consumer.HandleTranslationUnit(templateSourceAST->getASTContext());
+    return result;
+}
+
+/// Write all of a string to a file descriptor.
+static bool writeAll(int fd, const string &data) {
+    size_t written = 0;
+    while (written < data.size()) {
+        ssize_t count = write(fd, data.data() + written, data.size() - written);
+        if (count < 0 && errno == EINTR) continue;
+        if (count <= 0) return false;
+        written += count;
+    }
+    return true;
+}
+
+/// Read a file descriptor until the end of the file.
+static string readAll(int fd) {
+    string data;
+    char buffer[65536];
+    while (true) {
+        ssize_t count = read(fd, buffer, sizeof(buffer));
+        if (count < 0 && errno == EINTR) continue;
+        if (count <= 0) break;
+        data.append(buffer, count);
+    }
+    return data;
+}
+
+/// \brief Transform the source files in a number of worker processes, and merge their results.
+///
+/// Each worker process is forked from this process and transforms every N'th source file of the list, so no Clang state
+/// is shared between them. The workers report their results back through a pipe. Results are merged in the order
+/// of the workers, so the merged result does not depend on the order in which the workers finish.
+/// \see transformShard
+static ShardResult transformInProcesses(const SourceList &sourceFiles, const CompilationDatabase &compilations,
+                                        LHSConfiguration &lhsConfig, const string &LHSTemplateConfigFile,
+                                        const TransformOptions &options, const RunManifest *manifest, bool ownsTemplateSource) {
+    struct Worker {
+        pid_t pid;
+        int fd;
+    };
+    vector<Worker> workers;
     
-    unique_ptr<LHSTemplate> lhs(consumer.retrieveLHSTemplate());
+    // Make sure no buffered output gets duplicated into the workers
+    llvm::outs().flush();
+    llvm::errs().flush();
     
-    vector<ASTResult> results(lhs->matchAST(ASTs));
+    for (unsigned i = 0; i < options.processes; i++) {
+        SourceList part;
+        for (unsigned j = i; j < sourceFiles.size(); j += options.processes) {
+            part.push_back(sourceFiles[j]);
+        }
+        
+        int fds[2];
+        if (pipe(fds) != 0) {
+            llvm::errs() << "Unable to create a pipe for worker process " << i << "\n";
+            break;
+        }
+        
+        pid_t pid = fork();
+        if (pid < 0) {
+            llvm::errs() << "Unable to fork worker process " << i << "\n";
+            close(fds[0]);
+            close(fds[1]);
+            break;
+        }
+        
+        if (pid == 0) {
+            // Worker process, only the first worker transforms the template source
+            close(fds[0]);
+            int status = 0;
+            try {
+                ShardResult result(transformShard(part, compilations, lhsConfig, LHSTemplateConfigFile, options, manifest,
+                                                  ownsTemplateSource && i == 0));
+                json j = result;
+                if (!writeAll(fds[1], j.dump())) status = 1;
+            } catch (const exception &e) {
+                llvm::errs() << e.what() << "\n";
+                status = 1;
+            }
+            close(fds[1]);
+            llvm::outs().flush();
+            llvm::errs().flush();
+            _exit(status);
+        }
+        
+        close(fds[1]);
+        workers.push_back({ pid, fds[0] });
+    }
     
-    RHSTemplate rhs(lhsConfig.getRHSTemplate());
-    InternalCallback cb(rhs, lhsConfig.shouldOverwriteSourceFiles());
-    for (ASTResult &res : results) {
-        cb.setRewriter(llvm::make_unique<Rewriter>(res.ast->getSourceManager(), res.ast->getLangOpts()));
-        for (MatchResult &match : res.matches) {
-            cb.run(match);
+    ShardResult merged;
+    for (unsigned i = 0; i < workers.size(); i++) {
+        string output(readAll(workers[i].fd));
+        close(workers[i].fd);
+        
+        int status;
+        while (waitpid(workers[i].pid, &status, 0) < 0 && errno == EINTR);
+        
+        if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+            llvm::errs() << "Worker process " << i << " failed, its source files have not been transformed\n";
+            continue;
+        }
+        
+        try {
+            ShardResult result(json::parse(output).get<ShardResult>());
+            merged.report.merge(result.report);
+            merged.entries.insert(merged.entries.end(), result.entries.begin(), result.entries.end());
+        } catch (const exception &e) {
+            llvm::errs() << "Malformed result from worker process " << i << ": " << e.what() << "\n";
         }
-        cb.fileProcessed(res.ast->getSourceManager().getMainFileID(), res.ast->getMainFileName());
     }
+    
+    return merged;
 }
 
+/// Assign a source file to one of a number of shards, using a stable hash of its absolute path (FNV-1a).
+/// The assignment does not depend on the other source files, nor on the order in which they are given.
+static unsigned getShard(const string &sourceFile, unsigned shardCount) {
+    uint64_t hash = 14695981039346656037ULL;
+    for (char c : getAbsolutePath(sourceFile)) {
+        hash ^= static_cast<unsigned char>(c);
+        hash *= 1099511628211ULL;
+    }
+    return hash % shardCount;
+}
+
+TransformReport X::transform(SourceList sourceFiles, const CompilationDatabase &compilations, string LHSTemplateConfigFile,
+                             const TransformOptions &options) {
+    LHSConfiguration lhsConfig(LHSTemplateConfigFile);
+    
+    // Ensure the template source file also gets parsed
+    if (find(sourceFiles.begin(), sourceFiles.end(), lhsConfig.getTemplateSource()) != sourceFiles.end()
+        && compilations.getCompileCommands(lhsConfig.getTemplateSource()).empty()) {
+        llvm::errs() << "Template source file is not contained in the source list or the compilation database!\n";
+        return TransformReport();
+    }
+    
+    // Directories of serialized ASTs are transformed like the source files they were built from
+    sourceFiles = expandInputs(sourceFiles);
+    
+    // The template source is handled separately from the other source files
+    string templateSource(lhsConfig.getTemplateSource());
+    sourceFiles.erase(remove_if(sourceFiles.begin(), sourceFiles.end(),
+                                [&templateSource](const string &file) { return getAbsolutePath(file) == templateSource; }),
+                      sourceFiles.end());
+    
+    // Only keep the source files of our shard. Every shard needs the template, but only one may transform its source.
+    bool ownsTemplateSource = true;
+    if (options.shardCount > 1) {
+        sourceFiles.erase(remove_if(sourceFiles.begin(), sourceFiles.end(), [&options](const string &file) {
+            return getShard(file, options.shardCount) != options.shardIndex;
+        }), sourceFiles.end());
+        ownsTemplateSource = getShard(templateSource, options.shardCount) == options.shardIndex;
+    }
+    
+    unique_ptr<RunManifest> manifest;
+    if (!options.manifest.empty()) {
+        manifest = llvm::make_unique<RunManifest>(options.manifest);
+    }
+    
+    // In isolated mode, the worker processes are managed by the shard itself
+    ShardResult result;
+    if (options.processes > 1 && !options.isolate) {
+        result = transformInProcesses(sourceFiles, compilations, lhsConfig, LHSTemplateConfigFile, options, manifest.get(),
+                                      ownsTemplateSource);
+    } else {
+        result = transformShard(sourceFiles, compilations, lhsConfig, LHSTemplateConfigFile, options, manifest.get(),
+                                ownsTemplateSource);
+    }
+    
+    // Only this process writes the manifest, so worker processes never overwrite each other's entries
+    if (manifest) {
+        for (ManifestEntry &entry : result.entries) {
+            manifest->record(move(entry));
+        }
+        
+        if (!manifest->save()) {
+            llvm::errs() << "Unable to write run manifest " << options.manifest << "\n";
+        }
+    }
+    
+    return result.report;
+}
 
 // Explicit initialization of templates so we can still split header and source files
 template void X::transform<StatementMatcher>(const SourceList &sourceFiles, const CompilationDatabase &compilations, StatementMatcher &matcher, string rhs, bool overwriteChangedFiles);
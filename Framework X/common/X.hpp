@@ -13,13 +13,24 @@
 #include <vector>
 #include <fstream>
 
+#include <unistd.h>
+#include <sys/wait.h>
+
 #include <clang/ASTMatchers/ASTMatchers.h>
 #include <clang/ASTMatchers/ASTMatchFinder.h>
 #include <clang/Tooling/Tooling.h>
+#include <clang/Frontend/FrontendAction.h>
+#include <clang/Frontend/CompilerInstance.h>
 #include <clang/Rewrite/Core/Rewriter.h>
 #include <llvm/Support/Path.h>
 #include <llvm/Support/raw_os_ostream.h>
+#include <llvm/Support/MemoryBuffer.h>
 
+#include "ASTBuilder.hpp"
+#include "TokenPrefilter.hpp"
+#include "RunManifest.hpp"
+#include "TransformReport.hpp"
+#include "WorkerPool.hpp"
 #include "../RHS/RHSTemplate.hpp"
 #include "../LHS/LHSConfiguration.hpp"
 #include "../LHS/LHSTemplateParser.hpp"
@@ -32,6 +43,17 @@ using namespace std;
 using SourceList = vector<string>;
 namespace X {
 
+/// Options for the template-based transformation
+struct TransformOptions : ParseOptions {
+    bool prefilter = false; ///< Skip source files which do not contain the identifiers required by the template, without parsing them.
+    string manifest; ///< Path to the run manifest, used to skip source files that are unchanged since the last run. Empty to disable.
+    unsigned shardIndex = 0; ///< The shard of the source files to transform, see shardCount.
+    unsigned shardCount = 1; ///< The number of shards the source files are divided into, based on a hash of their path.
+    unsigned processes = 1; ///< The number of worker processes the source files are divided among.
+    bool isolate = false; ///< Parse and match every source file in a recycled worker process, see WorkerPool.
+    WorkerLimits workerLimits; ///< The limits of the worker processes in isolated mode.
+};
+
 /// \class XCallback
 /// \brief A class implementing a callback for AST matching
 /// \see MatchFinder::MatchCallback
@@ -63,6 +85,7 @@ public:
 ///
 /// LHS matching will be performed by conventional AST match finders. A RHS template will be
 /// instantiated for each match and the replacement will be applied onto the original source file.
+/// Each source file is matched as soon as it has been parsed, and its AST is released before the next one is parsed.
 /// \param sourceFiles The source files to be transformed.
 /// \param compilations The compilation database.
 /// \param matcher The LHS matcher.
@@ -85,13 +108,26 @@ template <typename MatcherType>
 void transform(const SourceList &sourceFiles, const CompilationDatabase &compilations, MatcherType &matcher, XCallback &cb);
 
 /// \brief Transform a source file using templates at the LHS and RHS
-/// \param sourceFiles The source files to be transformed.
+///
+/// Source files are processed in a streaming fashion: each translation unit is parsed, matched, rewritten and written
+/// before the next one is parsed, after which its AST is released. Only the AST of the template source is kept alive
+/// for the whole run.
+///
+/// When sharding, only the source files whose path hashes to the given shard are transformed, so a number of
+/// independent runs can divide the source files among each other. When using multiple processes, the source files
+/// are divided among forked worker processes, whose statistics and manifest entries are merged afterwards.
+/// In isolated mode, each source file is instead handed to one of a pool of worker processes, which are forked after the
+/// template has been built. A source file whose worker crashes or exceeds its limits is retried, and eventually skipped.
+/// \param sourceFiles The source files to be transformed. May contain serialized `.ast` files, or directories thereof.
 /// \param compilations The compilation database.
 /// \param LHSTemplateConfigFile The path to the LHS template configuration file
+/// \param options Options for the transformation, e.g. the number of parallel jobs used for parsing.
+/// \return Statistics of the transformation, merged over all worker processes.
 /// \note   The LHS template source file must also be in the sourceFiles list and the compilation database, as it needs to be parsed.
 ///         Parsing won't happen if it is not contained in the compilation database!
 // The sourceFiles are passed by value instead of reference and not constant, as we need a copy of the vector because may be modifying it
-void transform(SourceList sourceFiles, const CompilationDatabase &compilations, string LHSTemplateConfigFile);
+TransformReport transform(SourceList sourceFiles, const CompilationDatabase &compilations, string LHSTemplateConfigFile,
+                          const TransformOptions &options = TransformOptions());
     
 } // namespace X
 
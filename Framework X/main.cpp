@@ -16,11 +16,77 @@ using namespace X;
 
 static llvm::cl::OptionCategory ToolCategory("C++ Template Transformation Tool");
 
+static llvm::cl::opt<unsigned> Jobs("j", llvm::cl::desc("Number of worker threads used to parse the source files"),
+                                    llvm::cl::value_desc("N"), llvm::cl::init(1), llvm::cl::cat(ToolCategory));
+
+static llvm::cl::opt<string> PrefixHeader("prefix-header", llvm::cl::desc("Header to precompile once and include in every source file"),
+                                          llvm::cl::value_desc("file"), llvm::cl::cat(ToolCategory));
+
+static llvm::cl::opt<string> Shard("shard", llvm::cl::desc("Only transform the source files in shard i out of N"),
+                                   llvm::cl::value_desc("i/N"), llvm::cl::cat(ToolCategory));
+
+static llvm::cl::opt<unsigned> Processes("processes", llvm::cl::desc("Number of worker processes the source files are divided among"),
+                                         llvm::cl::value_desc("N"), llvm::cl::init(1), llvm::cl::cat(ToolCategory));
+
+static llvm::cl::opt<bool> Isolate("isolate", llvm::cl::desc("Parse and match every source file in one of a pool of recycled worker processes"),
+                                   llvm::cl::cat(ToolCategory));
+
+static llvm::cl::opt<unsigned> Timeout("timeout", llvm::cl::desc("Number of seconds after which a source file is aborted in isolated mode"),
+                                       llvm::cl::value_desc("seconds"), llvm::cl::init(0), llvm::cl::cat(ToolCategory));
+
+static llvm::cl::opt<unsigned> MemoryLimit("memory-limit", llvm::cl::desc("Resident memory after which a worker is aborted in isolated mode"),
+                                           llvm::cl::value_desc("MB"), llvm::cl::init(0), llvm::cl::cat(ToolCategory));
+
+static llvm::cl::opt<unsigned> Recycle("recycle", llvm::cl::desc("Number of source files after which a worker is replaced in isolated mode"),
+                                       llvm::cl::value_desc("N"), llvm::cl::init(0), llvm::cl::cat(ToolCategory));
+
+static llvm::cl::opt<unsigned> Retries("retries", llvm::cl::desc("Number of times a source file is retried after its worker failed in isolated mode"),
+                                       llvm::cl::value_desc("N"), llvm::cl::init(1), llvm::cl::cat(ToolCategory));
+
+static llvm::cl::opt<bool> Stats("stats", llvm::cl::desc("Print statistics of the transformation as JSON"),
+                                 llvm::cl::cat(ToolCategory));
+
+static llvm::cl::opt<string> CacheDirectory("cache-dir", llvm::cl::desc("Directory in which parsed ASTs are cached between runs"),
+                                            llvm::cl::value_desc("dir"), llvm::cl::cat(ToolCategory));
+
+static llvm::cl::opt<bool> Prefilter("prefilter", llvm::cl::desc("Skip source files which do not contain the identifiers of the template"),
+                                     llvm::cl::cat(ToolCategory));
+
+static llvm::cl::opt<string> Manifest("manifest", llvm::cl::desc("Manifest used to skip source files that are unchanged since the last run"),
+                                      llvm::cl::value_desc("file"), llvm::cl::cat(ToolCategory));
+
 int main(int argc, const char **argv) {
     clang::tooling::CommonOptionsParser op(argc, argv, ToolCategory);
     
+    TransformOptions options;
+    options.jobs = Jobs;
+    options.prefixHeader = PrefixHeader;
+    options.cacheDirectory = CacheDirectory;
+    options.prefilter = Prefilter;
+    options.manifest = Manifest;
+    options.processes = Processes;
+    options.isolate = Isolate;
+    options.workerLimits.timeout = Timeout;
+    options.workerLimits.memoryLimit = MemoryLimit;
+    options.workerLimits.recycleAfter = Recycle;
+    options.workerLimits.retries = Retries;
+    
+    if (!Shard.empty()) {
+        // Expect the shard as "i/N", with i < N
+        llvm::StringRef index, count;
+        std::tie(index, count) = llvm::StringRef(Shard).split('/');
+        if (index.getAsInteger(10, options.shardIndex) || count.getAsInteger(10, options.shardCount)
+            || options.shardCount == 0 || options.shardIndex >= options.shardCount) {
+            llvm::errs() << "Invalid shard " << Shard << ", expected i/N with 0 <= i < N\n";
+            return 1;
+        }
+    }
+    
     try {
-        X::transform(op.getSourcePathList(), op.getCompilations(), "config.json");
+        TransformReport report(X::transform(op.getSourcePathList(), op.getCompilations(), "config.json", options));
+        if (Stats) {
+            llvm::outs() << json(report).dump(2) << "\n";
+        }
     } catch (const MalformedConfigException& e) {
         llvm::errs() << e.what() << "\n";
     }